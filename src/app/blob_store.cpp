@@ -0,0 +1,110 @@
+#include "blob_store.hpp"
+#include "database.hpp"
+#include "global.hpp"
+
+#include <glog/logging.h>
+#include <openssl/sha.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+namespace app
+{
+
+using std::ifstream;
+using std::ostringstream;
+using std::vector;
+
+string
+blob_store::digest_of ( path const& file )
+{
+    SHA256_CTX ctx;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    vector< char > buffer ( 65536 );
+
+    ifstream ifs ( file.string(), ifstream::binary );
+    if ( !ifs )
+        return "";
+
+    SHA256_Init ( &ctx );
+    while ( ifs.read ( buffer.data(), buffer.size() ) || ifs.gcount() > 0 )
+        SHA256_Update ( &ctx, buffer.data(), ifs.gcount() );
+    SHA256_Final ( digest, &ctx );
+
+    ostringstream hex;
+    hex << std::hex << std::setfill ( '0' );
+    for ( size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i )
+        hex << std::setw ( 2 ) << static_cast< int > ( digest[i] );
+
+    return hex.str();
+}
+
+path
+blob_store::blob_path ( string const& digest ) const
+{
+    return root_ / digest.substr ( 0, 2 ) / digest;
+}
+
+string
+blob_store::add ( path const& file )
+{
+    auto digest = digest_of ( file );
+    if ( digest.empty() )
+    {
+        LOG ( ERROR ) << "Could not hash " << file;
+        return digest;
+    }
+
+    auto blob = blob_path ( digest );
+    boost::system::error_code ec;
+
+    if ( !exists ( blob, ec ) )
+    {
+        create_directories ( blob.parent_path(), ec );
+
+        // A hard link shares the snapshot's bytes; fall back to a copy when
+        // the store lives on another file system.
+        create_hard_link ( file, blob, ec );
+        if ( ec )
+            copy_file ( file, blob, copy_option::overwrite_if_exists, ec );
+        if ( ec )
+        {
+            LOG ( ERROR ) << "Could not store blob " << digest << ": " << ec.message();
+            return "";
+        }
+    }
+
+    long long size = file_size ( blob, ec );
+    submit_write ( [ digest, size ] {
+        statement insert ( "INSERT OR IGNORE INTO blobs (digest, size, uploaded) VALUES (?, ?, 0)" );
+        if ( !insert.bind ( 1, digest ).bind ( 2, size ).exec() )
+        {
+            LOG ( INFO ) << "Could not register blob in database.";
+            return false;
+        }
+        return true;
+    } );
+
+    return digest;
+}
+
+void
+blob_store::link ( string const& digest, path const& to )
+{
+    boost::system::error_code ec;
+    auto blob = blob_path ( digest );
+
+    if ( equivalent ( blob, to, ec ) )
+        return;
+
+    remove ( to, ec );
+    create_hard_link ( blob, to, ec );
+    if ( ec )
+        copy_file ( blob, to, copy_option::overwrite_if_exists, ec );
+    if ( ec )
+        LOG ( ERROR ) << "Could not link blob " << digest << " to " << to;
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef BLOB_STORE_HPP
+#define BLOB_STORE_HPP
+
+#include <boost/filesystem.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+
+namespace app
+{
+
+using namespace boost::filesystem;
+using std::string;
+
+// Content-addressed store for evidence files. Each distinct file is kept
+// once under <root>/<first two hex digits>/<sha256> and recorded in the
+// blobs table; event directories hold hard links to the stored copy.
+class blob_store : boost::noncopyable
+{
+public:
+    blob_store ( path const& root ) : root_ ( root ) {}
+    ~blob_store() {}
+
+    // Hashes the file, stores it if the digest is new and returns the digest.
+    string add ( path const & );
+
+    // Makes the blob appear at the given path without copying its bytes.
+    void link ( string const &, path const & );
+
+    path blob_path ( string const & ) const;
+    static string digest_of ( path const & );
+
+private:
+    path root_;
+};
+
+}
+
+#endif
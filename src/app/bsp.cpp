@@ -1,4 +1,5 @@
 #include "bsp.hpp"
+#include "global.hpp"
 
 #include <qp_port.h>
 
@@ -23,6 +24,9 @@ void QF_onClockTick()
     QF::TICK(&clock_tick);
 }
 
-extern "C" void Q_onAssert(char const Q_ROM * const file, int line) {}
+extern "C" void Q_onAssert(char const Q_ROM * const file, int line)
+{
+    global::qp_assert_failed(file, line);
+}
 
 }
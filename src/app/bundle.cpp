@@ -0,0 +1,200 @@
+#include "bundle.hpp"
+
+#include <glog/logging.h>
+#include <json/json.h>
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+namespace app
+{
+
+using std::ifstream;
+
+namespace
+{
+
+const size_t block_size = 512;
+
+// ustar header layout, see POSIX pax(1).
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+void put_octal ( char* field, size_t width, uintmax_t value )
+{
+    std::snprintf ( field, width, "%0*llo", int ( width - 1 ),
+                    static_cast< unsigned long long > ( value ) );
+}
+
+}
+
+void
+event_bundle::add ( path const& file, string const& digest )
+{
+    boost::system::error_code ec;
+    member m;
+    m.file = file;
+    m.digest = digest;
+    m.size = file_size ( file, ec );
+    if ( ec )
+    {
+        LOG ( WARNING ) << "Leaving " << file << " out of bundle: " << ec.message();
+        return;
+    }
+
+    members_.push_back ( m );
+}
+
+bool
+event_bundle::write ( ptree const& event )
+{
+    Json::Value manifest;
+    BOOST_FOREACH ( ptree::value_type const& field, event )
+    {
+        manifest[field.first] = field.second.data();
+    }
+
+    Json::Value files ( Json::arrayValue );
+    BOOST_FOREACH ( auto const& m, members_ )
+    {
+        Json::Value entry;
+        entry["name"] = m.file.filename().string();
+        entry["size"] = static_cast< Json::UInt > ( m.size );
+        if ( !m.digest.empty() )
+            entry["sha256"] = m.digest;
+        files.append ( entry );
+    }
+    manifest["files"] = files;
+
+    Json::StyledWriter writer;
+    auto manifest_text = writer.write ( manifest );
+
+    // Build under a temporary name so the uploader never sees half an
+    // archive.
+    path partial = archive_;
+    partial += ".part";
+
+    ofstream ofs ( partial.string(), ofstream::binary | ofstream::trunc );
+    bool ok = ofs.good();
+    time_t now = std::time ( NULL );
+
+    ok = ok && write_header ( ofs, "manifest.json", manifest_text.size(), now );
+    ok = ok && ofs.write ( manifest_text.data(), manifest_text.size() );
+    ok = ok && write_padding ( ofs, manifest_text.size() );
+
+    BOOST_FOREACH ( auto const& m, members_ )
+    {
+        if ( !ok )
+            break;
+
+        boost::system::error_code ec;
+        time_t mtime = last_write_time ( m.file, ec );
+        ok = write_header ( ofs, m.file.filename().string(), m.size, ec ? now : mtime )
+             && write_data ( ofs, m.file )
+             && write_padding ( ofs, m.size );
+    }
+
+    // Two zero blocks end the archive.
+    char end[block_size * 2] = {};
+    ok = ok && ofs.write ( end, sizeof ( end ) );
+    ofs.close();
+
+    boost::system::error_code ec;
+    if ( ok )
+        rename ( partial, archive_, ec );
+
+    if ( !ok || ec )
+    {
+        LOG ( ERROR ) << "Could not write bundle " << archive_;
+        remove ( partial, ec );
+        return false;
+    }
+
+    LOG ( INFO ) << "Bundled " << members_.size() << " file(s) into " << archive_;
+    return true;
+}
+
+bool
+event_bundle::write_header ( ofstream& ofs, string const& name, uintmax_t size, time_t mtime )
+{
+    if ( name.size() >= sizeof ( tar_header().name ) )
+    {
+        LOG ( ERROR ) << "Bundle member name too long: " << name;
+        return false;
+    }
+
+    tar_header header;
+    std::memset ( &header, 0, sizeof ( header ) );
+    std::memcpy ( header.name, name.data(), name.size() );
+    put_octal ( header.mode, sizeof ( header.mode ), 0644 );
+    put_octal ( header.uid, sizeof ( header.uid ), 0 );
+    put_octal ( header.gid, sizeof ( header.gid ), 0 );
+    put_octal ( header.size, sizeof ( header.size ), size );
+    put_octal ( header.mtime, sizeof ( header.mtime ), mtime );
+    header.typeflag = '0';
+    std::memcpy ( header.magic, "ustar", 6 );
+    std::memcpy ( header.version, "00", 2 );
+
+    // The checksum is computed with its own field filled with spaces.
+    std::memset ( header.checksum, ' ', sizeof ( header.checksum ) );
+    unsigned int sum = 0;
+    auto bytes = reinterpret_cast< unsigned char const* > ( &header );
+    for ( size_t i = 0; i < sizeof ( header ); ++i )
+        sum += bytes[i];
+    std::snprintf ( header.checksum, sizeof ( header.checksum ), "%06o", sum );
+    header.checksum[7] = ' ';
+
+    return ofs.write ( reinterpret_cast< char const* > ( &header ), sizeof ( header ) ).good();
+}
+
+bool
+event_bundle::write_data ( ofstream& ofs, path const& file )
+{
+    ifstream ifs ( file.string(), ifstream::binary );
+    if ( !ifs )
+        return false;
+
+    vector< char > buffer ( 65536 );
+    while ( ifs.read ( buffer.data(), buffer.size() ) || ifs.gcount() > 0 )
+    {
+        if ( !ofs.write ( buffer.data(), ifs.gcount() ) )
+            return false;
+    }
+
+    return true;
+}
+
+bool
+event_bundle::write_padding ( ofstream& ofs, uintmax_t size )
+{
+    char zeros[block_size] = {};
+    size_t remainder = size % block_size;
+    if ( remainder == 0 )
+        return true;
+
+    return ofs.write ( zeros, block_size - remainder ).good();
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef BUNDLE_HPP
+#define BUNDLE_HPP
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/utility.hpp>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using namespace boost::filesystem;
+using boost::property_tree::ptree;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+// Packs the evidence of one event into an uncompressed tar archive with a
+// manifest.json as its first entry, so the event reaches the server as a
+// single object. Members are streamed from disk and never held in memory.
+class event_bundle : boost::noncopyable
+{
+public:
+    event_bundle ( path const& archive ) : archive_ ( archive ) {}
+    ~event_bundle() {}
+
+    void add ( path const& file, string const& digest );
+
+    // Writes the archive; the event fields in the given tree are copied
+    // into the manifest. Returns false and leaves nothing behind on error.
+    bool write ( ptree const& event );
+
+private:
+    struct member
+    {
+        path file;
+        string digest;
+        uintmax_t size;
+    };
+
+    bool write_header ( ofstream &, string const& name, uintmax_t size, time_t mtime );
+    bool write_data ( ofstream &, path const & );
+    bool write_padding ( ofstream &, uintmax_t size );
+
+private:
+    path archive_;
+    vector< member > members_;
+};
+
+}
+
+#endif
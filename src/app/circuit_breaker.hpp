@@ -0,0 +1,88 @@
+#ifndef CIRCUIT_BREAKER_HPP
+#define CIRCUIT_BREAKER_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <algorithm>
+
+namespace app
+{
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+
+// Stops all upload attempts after a run of consecutive failures. Once the
+// cooldown has passed a single probe is let through; its success closes
+// the breaker again, its failure reopens it with a doubled cooldown.
+class circuit_breaker
+{
+public:
+    enum state
+    {
+        closed,
+        open,
+        half_open
+    };
+
+    circuit_breaker ( size_t threshold, time_duration cooldown, time_duration max_cooldown )
+        : state_ ( closed ), threshold_ ( std::max ( threshold, size_t ( 1 ) ) ),
+          failures_ ( 0 ), base_cooldown_ ( cooldown ), cooldown_ ( cooldown ),
+          max_cooldown_ ( max_cooldown ) {}
+
+    // Whether an attempt may start now. Moves an open breaker whose
+    // cooldown has elapsed into half_open, which allows one probe.
+    bool allow()
+    {
+        if ( state_ == open && microsec_clock::universal_time() >= reopen_at_ )
+            state_ = half_open;
+
+        return state_ != open;
+    }
+
+    bool probing() const { return state_ == half_open; }
+
+    void succeeded()
+    {
+        state_ = closed;
+        failures_ = 0;
+        cooldown_ = base_cooldown_;
+    }
+
+    void failed()
+    {
+        if ( state_ == half_open )
+        {
+            cooldown_ = std::min ( cooldown_ * 2, max_cooldown_ );
+            trip();
+        }
+        else if ( ++failures_ >= threshold_ )
+        {
+            trip();
+        }
+    }
+
+    state current() const { return state_; }
+    time_duration cooldown() const { return cooldown_; }
+
+private:
+    void trip()
+    {
+        state_ = open;
+        failures_ = 0;
+        reopen_at_ = microsec_clock::universal_time() + cooldown_;
+    }
+
+private:
+    state state_;
+    size_t threshold_;
+    size_t failures_;
+    time_duration base_cooldown_;
+    time_duration cooldown_;
+    time_duration max_cooldown_;
+    ptime reopen_at_;
+};
+
+}
+
+#endif
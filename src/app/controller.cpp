@@ -1,5 +1,6 @@
 #include "fsm.hpp"
 #include "common.hpp"
+#include "database.hpp"
 #include "global.hpp"
 
 #include <glog/logging.h>
@@ -8,6 +9,7 @@
 #include <boost/chrono.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/posix_time/posix_time_io.hpp>
+#include <boost/foreach.hpp>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
 
@@ -90,6 +92,8 @@ QP::QState controller::active(controller * const me, QP::QEvt const * const e)
         break;
     }
     case EVT_SHUTDOWN:
+        // Let queued writes reach the database first.
+        app::stop_writer();
         std::terminate();
         status = Q_HANDLED();
         break;
@@ -111,6 +115,16 @@ controller::process_command(string const& cmd)
         auto evt = Q_NEW(gevt, EVT_SHUTDOWN);
         this->postFIFO(evt);
     }
+    else if (cmd.find("stats") == 0)
+    {
+        ostringstream reply;
+        BOOST_FOREACH(ptree::value_type const& counter, global::stats())
+        {
+            reply << counter.first << "=" << counter.second.data() << "\n";
+        }
+        reply << "done\n";
+        asio::write(controll_socket_, asio::buffer(reply.str()));
+    }
     else
     {
         LOG(ERROR) << "Unknown command: " << cmd;
@@ -0,0 +1,458 @@
+#include "database.hpp"
+#include "global.hpp"
+#include "notifier.hpp"
+#include "squeue.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+namespace app
+{
+
+using boost::shared_ptr;
+using std::map;
+using std::ostringstream;
+using std::set;
+using std::vector;
+
+struct cached_statement
+{
+    cached_statement() : stmt ( NULL ), in_use ( false ) {}
+
+    sqlite3_stmt* stmt;
+    bool in_use;
+};
+
+// A connection and the statements compiled against it. Connections are
+// never shared between threads, so neither needs a lock.
+struct connection
+{
+    connection ( sqlite3* h ) : handle ( h ) {}
+    ~connection()
+    {
+        BOOST_FOREACH ( auto& cached, statements )
+        {
+            sqlite3_finalize ( cached.second.stmt );
+        }
+        sqlite3_close ( handle );
+    }
+
+    sqlite3* handle;
+    map< string, cached_statement > statements;
+};
+
+namespace
+{
+
+struct pending_write
+{
+    write_job job;
+    shared_ptr< std::promise< bool > > done;
+};
+
+string database_file;
+int cache_size = -2000;
+long long mmap_size = 0;
+int busy_timeout = 5000;
+std::chrono::milliseconds commit_interval ( 200 );
+size_t max_group = 256;
+
+connection* writer_connection = NULL;
+boost::thread writer_thread;
+boost::thread::id writer_id;
+squeue< pending_write > write_queue;
+
+boost::thread_specific_ptr< connection > reader_connection;
+
+// Tables changed by the jobs of the open transaction; writer thread only.
+set< string > changed_tables;
+
+void apply_pragma ( sqlite3* handle, string const& pragma )
+{
+    if ( sqlite3_exec ( handle, ( "PRAGMA " + pragma ).c_str(), 0, 0, 0 ) != SQLITE_OK )
+    {
+        LOG ( WARNING ) << "PRAGMA " << pragma << " failed: " << sqlite3_errmsg ( handle );
+    }
+}
+
+void tune ( sqlite3* handle )
+{
+    ostringstream cache, mmap;
+    cache << "cache_size=" << cache_size;
+    mmap << "mmap_size=" << mmap_size;
+
+    apply_pragma ( handle, cache.str() );
+    apply_pragma ( handle, mmap.str() );
+    sqlite3_busy_timeout ( handle, busy_timeout );
+}
+
+connection* this_thread_connection()
+{
+    if ( writer_connection && boost::this_thread::get_id() == writer_id )
+        return writer_connection;
+
+    // Before the writer starts, everything runs on the one handle that
+    // init_database opened.
+    if ( !writer_connection )
+    {
+        static connection* init = new connection ( global::get_database_handle() );
+        return init;
+    }
+
+    if ( !reader_connection.get() )
+    {
+        sqlite3* handle = NULL;
+        if ( sqlite3_open_v2 ( database_file.c_str(), &handle,
+                               SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL ) != SQLITE_OK )
+        {
+            LOG ( ERROR ) << "Could not open reader connection: " << sqlite3_errmsg ( handle );
+        }
+        tune ( handle );
+        reader_connection.reset ( new connection ( handle ) );
+        global::stat_add ( "db.reader_connections", 1 );
+    }
+
+    return reader_connection.get();
+}
+
+bool run_in_savepoint ( write_job const& job )
+{
+    if ( !statement ( "SAVEPOINT write_job" ).exec() )
+        return false;
+
+    bool ok = false;
+    try
+    {
+        ok = job();
+    }
+    catch ( std::exception const& e )
+    {
+        LOG ( ERROR ) << "Write failed: " << e.what();
+    }
+
+    if ( !ok )
+        statement ( "ROLLBACK TO write_job" ).exec();
+    statement ( "RELEASE write_job" ).exec();
+
+    return ok;
+}
+
+void write_loop()
+{
+    while ( true )
+    {
+        vector< pending_write > group;
+        vector< bool > results;
+
+        // Take whatever is queued already; the loop ends once the queue
+        // is closed and drained.
+        if ( write_queue.pop_batch ( group, max_group ) == 0 )
+            return;
+        auto deadline = std::chrono::steady_clock::now() + commit_interval;
+
+        // Everything that arrives before the deadline rides on the same
+        // commit.
+        statement ( "BEGIN" ).exec();
+        BOOST_FOREACH ( auto const& w, group )
+        {
+            results.push_back ( run_in_savepoint ( w.job ) );
+        }
+
+        pending_write next;
+        while ( group.size() < max_group && write_queue.pop ( next, deadline ) )
+        {
+            group.push_back ( next );
+            results.push_back ( run_in_savepoint ( next.job ) );
+        }
+
+        bool committed = statement ( "COMMIT" ).exec();
+        if ( !committed )
+        {
+            LOG ( ERROR ) << "Could not commit " << group.size() << " write(s): "
+                          << sqlite3_errmsg ( writer_connection->handle );
+            statement ( "ROLLBACK" ).exec();
+        }
+
+        global::stat_add ( "db.commits", 1 );
+        global::stat_add ( "db.writes", group.size() );
+        global::stat_set ( "db.queue_depth", write_queue.size() );
+
+        set< string > tables;
+        tables.swap ( changed_tables );
+        if ( committed )
+        {
+            BOOST_FOREACH ( auto const& table, tables )
+            {
+                notify_change ( table );
+            }
+        }
+
+        for ( size_t i = 0; i < group.size(); ++i )
+        {
+            if ( group[i].done )
+                group[i].done->set_value ( committed && results[i] );
+        }
+    }
+}
+
+}
+
+void
+start_writer ( sqlite3* handle, ptree const& config )
+{
+    database_file = sqlite3_db_filename ( handle, "main" );
+    cache_size = config.get ( "database.cache_size", -2000 );
+    mmap_size = config.get ( "database.mmap_size", 0LL );
+    busy_timeout = config.get ( "database.busy_timeout", 5000 );
+    commit_interval = std::chrono::milliseconds ( config.get ( "database.commit_interval", 200 ) );
+    max_group = std::max ( config.get< size_t > ( "database.max_group", 256 ), size_t ( 1 ) );
+
+    // Producers wait once this many writes are queued rather than let a
+    // stalled disk grow the queue without bound.
+    write_queue.limit ( config.get< size_t > ( "database.queue_capacity", 10000 ), overflow_block );
+
+    // WAL lets the reader connections run while the writer commits, and
+    // NORMAL sync only fsyncs the log at checkpoints.
+    if ( config.get ( "database.wal", true ) )
+        apply_pragma ( handle, "journal_mode=WAL" );
+    apply_pragma ( handle, "synchronous=" + config.get< string > ( "database.synchronous", "NORMAL" ) );
+    tune ( handle );
+
+    LOG ( INFO ) << "database writer: commit interval " << commit_interval.count() << "ms"
+                 << " cache_size " << cache_size << " mmap_size " << mmap_size;
+
+    // The writer records its own id before it touches the database, so
+    // its first statement already resolves to the writer connection.
+    std::promise< void > started;
+    writer_connection = new connection ( handle );
+    writer_thread = boost::thread ( [ &started ] {
+        writer_id = boost::this_thread::get_id();
+        started.set_value();
+        write_loop();
+    } );
+    started.get_future().wait();
+}
+
+void
+stop_writer()
+{
+    write_queue.close();
+    if ( writer_thread.joinable() && boost::this_thread::get_id() != writer_id )
+        writer_thread.join();
+}
+
+void
+submit_write ( write_job job )
+{
+    // The writer would wait on itself if the queue were full.
+    if ( writer_connection && boost::this_thread::get_id() == writer_id )
+    {
+        run_in_savepoint ( job );
+        return;
+    }
+
+    pending_write w;
+    w.job = job;
+    if ( !write_queue.push ( w ) )
+        LOG ( WARNING ) << "database writer stopped, write discarded.";
+}
+
+bool
+execute_write ( write_job job )
+{
+    // The writer cannot wait on itself.
+    if ( writer_connection && boost::this_thread::get_id() == writer_id )
+        return run_in_savepoint ( job );
+
+    pending_write w;
+    w.job = job;
+    w.done = boost::make_shared< std::promise< bool > >();
+    auto result = w.done->get_future();
+    if ( !write_queue.push ( w ) )
+        return false;
+
+    return result.get();
+}
+
+void
+changed ( string const& table )
+{
+    if ( writer_connection && boost::this_thread::get_id() == writer_id )
+        changed_tables.insert ( table );
+    else
+        notify_change ( table );
+}
+
+statement::statement ( string const& sql ) : conn_ ( this_thread_connection() ), stmt_ ( NULL ), cached_ ( NULL )
+{
+    auto& cached = conn_->statements[sql];
+
+    // A statement already checked out further up this thread's stack gets
+    // a one-off copy rather than being reset underneath its user.
+    if ( cached.in_use )
+    {
+        if ( sqlite3_prepare_v2 ( conn_->handle, sql.c_str(), -1, &stmt_, NULL ) != SQLITE_OK )
+        {
+            LOG ( ERROR ) << "Could not prepare statement: " << sqlite3_errmsg ( conn_->handle )
+                          << " [" << sql << "]";
+            sqlite3_finalize ( stmt_ );
+            stmt_ = NULL;
+        }
+        return;
+    }
+
+    if ( !cached.stmt )
+    {
+        if ( sqlite3_prepare_v2 ( conn_->handle, sql.c_str(), -1, &cached.stmt, NULL ) != SQLITE_OK )
+        {
+            LOG ( ERROR ) << "Could not prepare statement: " << sqlite3_errmsg ( conn_->handle )
+                          << " [" << sql << "]";
+            sqlite3_finalize ( cached.stmt );
+            cached.stmt = NULL;
+        }
+        else
+        {
+            global::stat_add ( "db.statements_prepared", 1 );
+        }
+    }
+
+    cached.in_use = cached.stmt != NULL;
+    cached_ = &cached;
+    stmt_ = cached.stmt;
+}
+
+statement::~statement()
+{
+    if ( !stmt_ )
+        return;
+
+    if ( !cached_ )
+    {
+        sqlite3_finalize ( stmt_ );
+        return;
+    }
+
+    sqlite3_reset ( stmt_ );
+    sqlite3_clear_bindings ( stmt_ );
+    cached_->in_use = false;
+}
+
+statement&
+statement::bind ( int index, string const& value )
+{
+    if ( stmt_ )
+        sqlite3_bind_text ( stmt_, index, value.data(), value.size(), SQLITE_TRANSIENT );
+    return *this;
+}
+
+statement&
+statement::bind ( int index, char const* value )
+{
+    if ( stmt_ )
+        sqlite3_bind_text ( stmt_, index, value, -1, SQLITE_TRANSIENT );
+    return *this;
+}
+
+statement&
+statement::bind ( int index, int value )
+{
+    if ( stmt_ )
+        sqlite3_bind_int ( stmt_, index, value );
+    return *this;
+}
+
+statement&
+statement::bind ( int index, long long value )
+{
+    if ( stmt_ )
+        sqlite3_bind_int64 ( stmt_, index, value );
+    return *this;
+}
+
+statement&
+statement::bind ( int index, double value )
+{
+    if ( stmt_ )
+        sqlite3_bind_double ( stmt_, index, value );
+    return *this;
+}
+
+statement&
+statement::bind_null ( int index )
+{
+    if ( stmt_ )
+        sqlite3_bind_null ( stmt_, index );
+    return *this;
+}
+
+bool
+statement::step()
+{
+    return stmt_ && sqlite3_step ( stmt_ ) == SQLITE_ROW;
+}
+
+bool
+statement::exec()
+{
+    if ( !stmt_ )
+        return false;
+
+    int result;
+    while ( ( result = sqlite3_step ( stmt_ ) ) == SQLITE_ROW )
+        ;
+
+    // Leave the statement ready for another exec() on the same checkout.
+    sqlite3_reset ( stmt_ );
+    return result == SQLITE_DONE;
+}
+
+int
+statement::column_int ( int column ) const
+{
+    return sqlite3_column_int ( stmt_, column );
+}
+
+long long
+statement::column_int64 ( int column ) const
+{
+    return sqlite3_column_int64 ( stmt_, column );
+}
+
+string
+statement::column_text ( int column ) const
+{
+    auto text = reinterpret_cast< const char * > ( sqlite3_column_text ( stmt_, column ) );
+    return text ? string ( text ) : string();
+}
+
+bool
+statement::column_null ( int column ) const
+{
+    return sqlite3_column_type ( stmt_, column ) == SQLITE_NULL;
+}
+
+int
+statement::changes() const
+{
+    return sqlite3_changes ( conn_->handle );
+}
+
+char const*
+statement::error() const
+{
+    return sqlite3_errmsg ( conn_->handle );
+}
+
+}
@@ -0,0 +1,91 @@
+#ifndef DATABASE_HPP
+#define DATABASE_HPP
+
+#include <sqlite3.h>
+
+#include <boost/function.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+
+namespace app
+{
+
+using boost::property_tree::ptree;
+using std::string;
+
+struct connection;
+struct cached_statement;
+
+// A compiled statement checked out of the calling thread's statement
+// registry. Each thread reads through a connection of its own and only
+// the writer thread holds the connection that writes; each SQL text is
+// prepared once per connection and reused. The statement is reset and
+// its bindings cleared when the object goes out of scope. Parameters are
+// bound by their 1-based position and never need quoting.
+class statement : boost::noncopyable
+{
+public:
+    explicit statement ( string const& sql );
+    ~statement();
+
+    bool ok() const { return stmt_ != NULL; }
+
+    statement& bind ( int, string const & );
+    statement& bind ( int, char const * );
+    statement& bind ( int, int );
+    statement& bind ( int, long long );
+    statement& bind ( int, double );
+    statement& bind_null ( int );
+
+    // Steps once; true while a row is available.
+    bool step();
+
+    // Runs the statement to completion; true if it succeeded.
+    bool exec();
+
+    int column_int ( int ) const;
+    long long column_int64 ( int ) const;
+    string column_text ( int ) const;
+    bool column_null ( int ) const;
+
+    // Rows changed by the last exec() on this connection.
+    int changes() const;
+
+    char const* error() const;
+
+private:
+    connection* conn_;
+    sqlite3_stmt* stmt_;
+    cached_statement* cached_;
+};
+
+// A unit of work for the writer thread. It runs inside a savepoint and
+// is rolled back on its own when it returns false.
+typedef boost::function< bool() > write_job;
+
+// Applies the [database] pragmas to the writer handle and starts the
+// writer thread.
+void start_writer ( sqlite3*, ptree const & );
+
+// Commits what is still queued and stops the writer thread. Writes
+// submitted afterwards are discarded.
+void stop_writer();
+
+// Queues a write; writes that arrive within database.commit_interval of
+// each other share one transaction and one fsync. Blocks while
+// database.queue_capacity writes are already waiting.
+void submit_write ( write_job );
+
+// Queues a write and waits until the transaction holding it committed.
+bool execute_write ( write_job );
+
+// Called from a write job to mark a table as changed. Subscribers of the
+// table are notified once the transaction commits, so they never look
+// for rows that are not visible yet.
+void changed ( string const& table );
+
+}
+
+#endif
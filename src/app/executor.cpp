@@ -0,0 +1,55 @@
+#include "executor.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+
+namespace app
+{
+
+namespace
+{
+
+boost::scoped_ptr< asio::io_service::work > work;
+boost::thread_group pool;
+
+}
+
+asio::io_service&
+shared_io_service()
+{
+    // Components create their timers before the pool starts, so the
+    // service exists from the first call on.
+    static asio::io_service* service = new asio::io_service();
+    return *service;
+}
+
+void
+start_executor ( ptree const& config )
+{
+    size_t threads = config.get< size_t > ( "executor.threads", 0 );
+    if ( threads == 0 )
+        threads = std::max ( boost::thread::hardware_concurrency(), 1u );
+
+    work.reset ( new asio::io_service::work ( shared_io_service() ) );
+    for ( size_t i = 0; i < threads; ++i )
+    {
+        pool.create_thread ( boost::bind ( &asio::io_service::run, &shared_io_service() ) );
+    }
+
+    LOG ( INFO ) << "executor: " << threads << " thread(s)";
+}
+
+void
+stop_executor()
+{
+    work.reset();
+    shared_io_service().stop();
+    pool.join_all();
+}
+
+}
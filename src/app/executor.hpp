@@ -0,0 +1,29 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace app
+{
+
+namespace asio = boost::asio;
+using boost::property_tree::ptree;
+
+// Process-wide io_service for the timers and sockets of the devices,
+// analyses and reports. Each component keeps its handlers on a strand of
+// its own, so they never run concurrently with each other while the pool
+// serves every component. Handlers should not block for long: a slow one
+// holds up a pool thread, not just its own component.
+asio::io_service& shared_io_service();
+
+// Starts executor.threads threads on the shared io_service, one per core
+// when unset.
+void start_executor ( ptree const & );
+
+// Stops the pool and waits for its threads.
+void stop_executor();
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "frame_ring.hpp"
+
+#include <algorithm>
+
+namespace app
+{
+
+namespace
+{
+
+struct frame_time
+{
+    bool operator() ( frame_ring::frame const& f, ptime const& t ) const { return f.time < t; }
+    bool operator() ( ptime const& t, frame_ring::frame const& f ) const { return t < f.time; }
+};
+
+}
+
+void
+frame_ring::push ( ptime const& time, image const& data )
+{
+    if ( !data )
+        return;
+
+    frame f = { time, data };
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    // Frames come in order but for clock steps.
+    auto pos = std::upper_bound ( frames_.begin(), frames_.end(), time, frame_time() );
+    frames_.insert ( pos, f );
+    bytes_ += data->size();
+    trim();
+}
+
+void
+frame_ring::resize ( size_t max_frames )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    max_frames_ = max_frames;
+    trim();
+}
+
+void
+frame_ring::trim()
+{
+    // The newest frame stays even if it alone is over the byte limit.
+    while ( frames_.size() > 1
+            && ( frames_.size() > max_frames_ || bytes_ > max_bytes_ ) )
+    {
+        if ( frames_.size() <= max_frames_ )
+            ++byte_evictions_;
+        bytes_ -= frames_.front().data->size();
+        frames_.pop_front();
+    }
+}
+
+vector< frame_ring::frame >
+frame_ring::between ( ptime const& from, ptime const& to ) const
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    auto first = std::lower_bound ( frames_.begin(), frames_.end(), from, frame_time() );
+    auto last = std::lower_bound ( first, frames_.end(), to, frame_time() );
+    return vector< frame > ( first, last );
+}
+
+size_t
+frame_ring::size() const
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    return frames_.size();
+}
+
+size_t
+frame_ring::bytes() const
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    return bytes_;
+}
+
+size_t
+frame_ring::byte_evictions() const
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    return byte_evictions_;
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef FRAME_RING_HPP
+#define FRAME_RING_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include <deque>
+#include <vector>
+
+namespace app
+{
+
+using boost::posix_time::ptime;
+using boost::shared_ptr;
+using std::vector;
+
+// The most recent JPEG frames of one camera, kept in memory. The ring is
+// bounded by a frame count and by the bytes it holds; whichever is hit
+// first pushes the oldest frames out. Frames are shared, so taking a
+// range freezes it: the frames stay alive for the caller after the ring
+// has moved on.
+class frame_ring : boost::noncopyable
+{
+public:
+    typedef shared_ptr< vector< char > const > image;
+
+    struct frame
+    {
+        ptime time;
+        image data;
+    };
+
+    frame_ring ( size_t max_frames, size_t max_bytes )
+        : max_frames_ ( max_frames ), max_bytes_ ( max_bytes ), bytes_ ( 0 ),
+          byte_evictions_ ( 0 ) {}
+    ~frame_ring() {}
+
+    void push ( ptime const &, image const & );
+
+    // Changes the frame bound; the byte bound stays.
+    void resize ( size_t max_frames );
+
+    // Frames taken at or after from and before to, oldest first.
+    vector< frame > between ( ptime const &, ptime const & ) const;
+
+    size_t size() const;
+    size_t bytes() const;
+    // Frames pushed out by the byte bound while the frame bound still had
+    // room for them.
+    size_t byte_evictions() const;
+
+private:
+    void trim();
+
+private:
+    size_t max_frames_;
+    size_t max_bytes_;
+    size_t bytes_;
+    size_t byte_evictions_;
+    mutable boost::mutex mutex_;
+    std::deque< frame > frames_;
+};
+
+}
+
+#endif
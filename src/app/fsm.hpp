@@ -2,6 +2,7 @@
 #define FSM_HPP
 
 #include "bsp.hpp"
+#include "upload_row.hpp"
 
 #include <qp_port.h>
 
@@ -9,11 +10,15 @@
 #include <boost/property_tree/ptree.hpp>
 
 #include <iostream>
+#include <string>
+#include <vector>
 
 namespace app
 {
 using boost::shared_ptr;
 using boost::property_tree::ptree;
+using std::string;
+using std::vector;
     
 enum signal
 {
@@ -40,6 +45,8 @@ enum signal
     
     EVT_EVENT_UPLOADED,
     EVT_EVENT_UPLOAD_FAILED,
+    EVT_UPLOAD_BATCH_FINISHED,
+    EVT_UPLOAD_PROGRESS,
     
     // Downloader events.
     EVT_LOGGED_IN,
@@ -70,6 +77,41 @@ public:
     virtual ~gevt() { args.clear(); }
 };
 
+// Typed events for the frequent signals. They come from the same pools as
+// gevt and their fields are moved in and out instead of going through
+// string keys; gevt stays for the rare and free-form events.
+
+// EVT_UPLOAD_EVENT: the rows of the next batch.
+class upload_evt : public QP::QEvt
+{
+public:
+    upload_evt ( QP::QSignal const s ) : QP::QEvt ( s ) {}
+    vector< upload_row > rows;
+};
+
+// EVT_EVENT_UPLOADED, EVT_EVENT_UPLOAD_FAILED and EVT_UPLOAD_PROGRESS for
+// one row of the batch in flight.
+class upload_status_evt : public QP::QEvt
+{
+public:
+    upload_status_evt ( QP::QSignal const s )
+        : QP::QEvt ( s ), attempts ( 0 ), rejected ( false ), sent_bytes ( 0 ) {}
+    string id;
+    int attempts;
+    bool rejected;
+    long long sent_bytes;
+};
+
+// EVT_VCA_EVENT: one line of vca output and the snapshot taken with it.
+class vca_evt : public QP::QEvt
+{
+public:
+    vca_evt ( QP::QSignal const s ) : QP::QEvt ( s ) {}
+    string timestamp;
+    string description;
+    string snapshot_path;
+};
+
 // Component creation functions.
 QP::QActive* create_controller();
 QP::QActive* create_uploader();
@@ -1,5 +1,8 @@
 #include "global.hpp"
 #include "common.hpp"
+#include "database.hpp"
+#include "retention.hpp"
+#include "schema.hpp"
 #include "fsm.hpp"
 #include "version.hpp"
 
@@ -11,8 +14,12 @@
 #include <boost/foreach.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/property_tree/ini_parser.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include <atomic>
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <vector>
 
@@ -20,6 +27,7 @@ namespace global
 {
 using boost::make_shared;
 using std::ifstream;
+using std::map;
 using std::ostringstream;
 using std::vector;
 
@@ -94,8 +102,44 @@ static QP::QEvt const** default_controller_equeue;
 static QP::QEvt const** default_uploader_equeue;
 static QP::QEvt const** default_vca_manager_equeue;
 
-typedef QF_MPOOL_EL ( app::gevt ) evt_block;
-static evt_block* small_pool;
+// Event types grouped by pool. QP hands each Q_NEW the first pool whose
+// blocks are large enough, so a burst of one kind of event only drains
+// the pool of its size class.
+union small_evt
+{
+    char upload[sizeof ( app::upload_evt )];
+};
+union medium_evt
+{
+    small_evt small;
+    char g[sizeof ( app::gevt )];
+    char upload_status[sizeof ( app::upload_status_evt )];
+};
+union large_evt
+{
+    medium_evt medium;
+    char vca[sizeof ( app::vca_evt )];
+};
+typedef QF_MPOOL_EL ( small_evt ) small_block;
+typedef QF_MPOOL_EL ( medium_evt ) medium_block;
+typedef QF_MPOOL_EL ( large_evt ) large_block;
+
+struct event_pool
+{
+    char const* name;
+    size_t block_size;
+    size_t blocks;
+    uint8_t id;
+};
+static vector< event_pool > event_pools;
+
+struct event_queue
+{
+    char const* name;
+    size_t size;
+    uint8_t prio;
+};
+static vector< event_queue > event_queues;
 
 QP::QActive* get_default_controller() { return default_controller; }
 QP::QActive* get_default_uploader() { return default_uploader; }
@@ -120,10 +164,43 @@ void qp_init()
     QP::QF::init();
 
     /* Initialize event pools */
-    size_t small_pool_size = global::config()->get("qp.small_pool_size", 100);
+    event_pool pools[] = {
+        { "small", sizeof ( small_block ),
+          global::config()->get<size_t>("qp.small_pool_size", 100), 0 },
+        { "medium", sizeof ( medium_block ),
+          global::config()->get<size_t>("qp.medium_pool_size", 100), 0 },
+        { "large", sizeof ( large_block ),
+          global::config()->get<size_t>("qp.large_pool_size", 100), 0 },
+    };
+
+    // QP wants the pools in strictly increasing block size. A size class
+    // that happens to be no larger than the one before it on this
+    // platform gives its blocks to that pool instead.
+    BOOST_FOREACH ( auto const& pool, pools )
+    {
+        if ( !event_pools.empty()
+             && event_pools.back().block_size >= pool.block_size )
+            event_pools.back().blocks += pool.blocks;
+        else
+            event_pools.push_back ( pool );
+    }
+
+    for ( size_t i = 0; i < event_pools.size(); ++i )
+    {
+        auto& pool = event_pools[i];
+        pool.id = i + 1;
+        void* storage = malloc ( pool.block_size * pool.blocks );
+        QP::QF::poolInit ( storage, pool.blocks, pool.block_size );
+        LOG ( INFO ) << "qp: " << pool.name << " event pool, "
+                     << pool.blocks << " blocks of " << pool.block_size << " bytes";
+    }
 
-    small_pool = ( evt_block * )malloc ( sizeof ( evt_block ) * small_pool_size );
-    QP::QF::poolInit(small_pool, small_pool_size, sizeof ( evt_block ));
+    event_queue queues[] = {
+        { "controller", controller_equeue_size, 1 },
+        { "uploader", uploader_equeue_size, 2 },
+        { "vca_manager", vca_manager_equeue_size, 3 },
+    };
+    event_queues.assign ( queues, queues + 3 );
 
     /* Create components */
     default_controller = app::create_controller();
@@ -148,6 +225,7 @@ int run()
 }
 
 sqlite3* sql;
+
 void init_database()
 {
     int error;
@@ -193,6 +271,23 @@ void init_database()
         LOG(INFO) << "Could not create table events.";
         throw "could not create table events";
     }
+
+    if (configuration->get("retention.enabled", true))
+    {
+        app::enable_incremental_vacuum(sql);
+    }
+
+    // Versioned upgrades: the upload bookkeeping columns, blobs and
+    // indexes. The uploader and retention need all of them.
+    if (app::upgrade_schema(sql) < app::schema_version)
+    {
+        LOG(INFO) << "Could not upgrade database schema.";
+        throw "could not upgrade database schema";
+    }
+
+    // From here on writes go through the writer thread.
+    app::start_writer(sql, *configuration);
+    app::start_retention(*configuration);
 }
 
 sqlite3* get_database_handle()
@@ -200,4 +295,96 @@ sqlite3* get_database_handle()
     return sql;
 }
 
+static boost::mutex stats_mutex;
+static map< string, long long > counters;
+
+void stat_add(string const& key, long long delta)
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    counters[key] += delta;
+}
+
+void stat_set(string const& key, long long value)
+{
+    boost::mutex::scoped_lock lock(stats_mutex);
+    counters[key] = value;
+}
+
+// Failed QP assertions, as recorded by qp_assert_failed. Q_onAssert runs
+// inside QP's critical section, so the hook only bumps these and the
+// counters are folded into the stats by update_qp_stats.
+static std::atomic< long long > qp_asserts ( 0 );
+static std::atomic< long long > qp_pool_asserts ( 0 );
+static std::atomic< long long > qp_queue_asserts ( 0 );
+static std::atomic< char const* > qp_assert_module ( nullptr );
+static std::atomic< int > qp_assert_line ( 0 );
+
+// Refreshes the QP pool and queue counters. QP keeps the lowest number of
+// free entries each one ever had, so the high water mark is the capacity
+// minus that margin.
+static void update_qp_stats()
+{
+    long long asserts = qp_asserts.exchange ( 0 );
+    long long pool_asserts = qp_pool_asserts.exchange ( 0 );
+    long long queue_asserts = qp_queue_asserts.exchange ( 0 );
+
+    if ( asserts > 0 )
+    {
+        LOG ( ERROR ) << "qp: " << asserts << " assertion(s) failed, last in "
+                      << qp_assert_module.load() << ":" << qp_assert_line.load();
+        stat_add ( "qp.asserts", asserts );
+    }
+
+    // QP asserts when Q_NEW finds its pool empty or an event does not fit
+    // a queue. The pool or queue that ran out is the one whose margin is
+    // down to zero.
+    BOOST_FOREACH ( auto const& pool, event_pools )
+    {
+        string key = string ( "qp.pool." ) + pool.name;
+        uint32_t margin = QP::QF::getPoolMargin ( pool.id );
+        stat_set ( key + ".block_size", pool.block_size );
+        stat_set ( key + ".blocks", pool.blocks );
+        stat_set ( key + ".high_water", pool.blocks - margin );
+        if ( pool_asserts > 0 && margin == 0 )
+            stat_add ( key + ".failures", pool_asserts );
+    }
+
+    BOOST_FOREACH ( auto const& queue, event_queues )
+    {
+        string key = string ( "qp.queue." ) + queue.name;
+        uint32_t margin = QP::QF::getQueueMargin ( queue.prio );
+        stat_set ( key + ".size", queue.size );
+        stat_set ( key + ".high_water", queue.size - margin );
+        if ( queue_asserts > 0 && margin == 0 )
+            stat_add ( key + ".failures", queue_asserts );
+    }
+}
+
+// Called from Q_onAssert inside QP's critical section: no QF calls, locks
+// or logging here, only the atomic counters above.
+void qp_assert_failed(char const* module, int line)
+{
+    qp_assert_module.store(module);
+    qp_assert_line.store(line);
+    if (strstr(module, "qf_new"))
+        ++qp_pool_asserts;
+    else if (strstr(module, "qa_fifo") || strstr(module, "qa_lifo"))
+        ++qp_queue_asserts;
+    ++qp_asserts;
+}
+
+ptree stats()
+{
+    update_qp_stats();
+
+    ptree snapshot;
+    boost::mutex::scoped_lock lock(stats_mutex);
+    for (auto it = counters.begin(); it != counters.end(); ++it)
+    {
+        // Keys contain dots, so use '/' as the path separator.
+        snapshot.put(ptree::path_type(it->first, '/'), it->second);
+    }
+    return snapshot;
+}
+
 }
@@ -29,12 +29,22 @@ QP::QActive* get_default_controller();
 QP::QActive* get_default_uploader();
 QP::QActive* get_default_vca_manager();
 
+// Records a failed QP assertion; called from Q_onAssert inside QP's
+// critical section. The stats command attributes it to the event pool or
+// queue that ran out.
+void qp_assert_failed(char const*, int);
+
 int run();
 
 // Database functions
 void init_database();
 sqlite3* get_database_handle();
 
+// Runtime counters, reported through the controller command socket.
+void stat_add(string const&, long long);
+void stat_set(string const&, long long);
+ptree stats();
+
 }
 
 #endif
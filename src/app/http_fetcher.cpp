@@ -0,0 +1,175 @@
+#include "global.hpp"
+#include "http_fetcher.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace app
+{
+
+using namespace boost::posix_time;
+
+http_fetcher::http_fetcher ( string const& name, long timeout )
+    : name_ ( name ), curl_ ( curl_easy_init() )
+{
+    if ( curl_ == NULL )
+    {
+        LOG ( ERROR ) << "fetcher [" << name_ << "]: cannot create curl handle";
+        return;
+    }
+
+    curl_easy_setopt ( curl_, CURLOPT_NOSIGNAL, 1L );
+    curl_easy_setopt ( curl_, CURLOPT_FAILONERROR, 1L );
+    curl_easy_setopt ( curl_, CURLOPT_TCP_KEEPALIVE, 1L );
+    curl_easy_setopt ( curl_, CURLOPT_CONNECTTIMEOUT, 10L );
+    curl_easy_setopt ( curl_, CURLOPT_TIMEOUT, timeout );
+}
+
+http_fetcher::~http_fetcher()
+{
+    if ( curl_ != NULL )
+        curl_easy_cleanup ( curl_ );
+}
+
+bool
+http_fetcher::fetch ( string const& url )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    // clear() keeps the capacity of the last frame.
+    buffer_.clear();
+    return perform ( url, &http_fetcher::buffer_callback, &buffer_ );
+}
+
+bool
+http_fetcher::fetch_to ( string const& url, path const& file )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    buffer_.clear();
+    if ( !perform ( url, &http_fetcher::buffer_callback, &buffer_ ) )
+        return false;
+
+    int fd = ::open ( file.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( fd < 0 )
+    {
+        LOG ( ERROR ) << "fetcher [" << name_ << "]: cannot create " << file;
+        return false;
+    }
+
+    size_t written = 0;
+    while ( written < buffer_.size() )
+    {
+        auto n = ::write ( fd, &buffer_[written], buffer_.size() - written );
+        if ( n <= 0 )
+            break;
+        written += n;
+    }
+    ::close ( fd );
+
+    if ( written < buffer_.size() )
+    {
+        LOG ( ERROR ) << "fetcher [" << name_ << "]: cannot write " << file;
+        return false;
+    }
+    return true;
+}
+
+bool
+http_fetcher::download ( string const& url, path const& file )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    std::FILE* out = std::fopen ( file.string().c_str(), "wb" );
+    if ( out == NULL )
+    {
+        LOG ( ERROR ) << "fetcher [" << name_ << "]: cannot create " << file;
+        return false;
+    }
+
+    bool ok = perform ( url, &http_fetcher::file_callback, out );
+    if ( std::fclose ( out ) != 0 )
+        ok = false;
+    return ok;
+}
+
+bool
+http_fetcher::stream ( string const& url, chunk_handler const& handler, long stall_timeout )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    if ( curl_ == NULL )
+        return false;
+
+    curl_easy_setopt ( curl_, CURLOPT_LOW_SPEED_LIMIT, 1L );
+    curl_easy_setopt ( curl_, CURLOPT_LOW_SPEED_TIME, stall_timeout );
+    bool ok = perform ( url, &http_fetcher::stream_callback, const_cast< chunk_handler* > ( &handler ) );
+    curl_easy_setopt ( curl_, CURLOPT_LOW_SPEED_LIMIT, 0L );
+    curl_easy_setopt ( curl_, CURLOPT_LOW_SPEED_TIME, 0L );
+    return ok;
+}
+
+bool
+http_fetcher::perform ( string const& url, curl_write_callback callback, void* userdata )
+{
+    if ( curl_ == NULL )
+        return false;
+
+    string key = "fetch." + name_ + ".";
+    global::stat_add ( key + "requests", 1 );
+
+    curl_easy_setopt ( curl_, CURLOPT_URL, url.c_str() );
+    curl_easy_setopt ( curl_, CURLOPT_WRITEFUNCTION, callback );
+    curl_easy_setopt ( curl_, CURLOPT_WRITEDATA, userdata );
+
+    auto start = microsec_clock::universal_time();
+    auto curl_error = curl_easy_perform ( curl_ );
+    auto elapsed = microsec_clock::universal_time() - start;
+    global::stat_set ( key + "latency_ms", elapsed.total_milliseconds() );
+
+    long connects = 0;
+    curl_easy_getinfo ( curl_, CURLINFO_NUM_CONNECTS, &connects );
+    global::stat_add ( key + "connects", connects );
+
+    if ( curl_error != CURLE_OK )
+    {
+        global::stat_add ( key + "failures", 1 );
+        LOG ( WARNING ) << "fetcher [" << name_ << "]: " << url
+                        << " failed: " << curl_easy_strerror ( curl_error );
+        return false;
+    }
+
+    double bytes = 0;
+    curl_easy_getinfo ( curl_, CURLINFO_SIZE_DOWNLOAD, &bytes );
+    global::stat_add ( key + "bytes", static_cast< long long > ( bytes ) );
+    return true;
+}
+
+size_t
+http_fetcher::buffer_callback ( char* ptr, size_t size, size_t nmemb, void* userdata )
+{
+    auto realsize = size * nmemb;
+    auto buffer = static_cast< vector< char >* > ( userdata );
+    buffer->insert ( buffer->end(), ptr, ptr + realsize );
+    return realsize;
+}
+
+size_t
+http_fetcher::file_callback ( char* ptr, size_t size, size_t nmemb, void* userdata )
+{
+    return std::fwrite ( ptr, size, nmemb, static_cast< std::FILE* > ( userdata ) ) * size;
+}
+
+size_t
+http_fetcher::stream_callback ( char* ptr, size_t size, size_t nmemb, void* userdata )
+{
+    auto realsize = size * nmemb;
+    auto handler = static_cast< chunk_handler* > ( userdata );
+    return ( *handler ) ( ptr, realsize ) ? realsize : 0;
+}
+
+}
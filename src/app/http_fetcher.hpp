@@ -0,0 +1,70 @@
+#ifndef HTTP_FETCHER_HPP
+#define HTTP_FETCHER_HPP
+
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using namespace boost::filesystem;
+using std::string;
+using std::vector;
+
+// HTTP GET client that keeps one curl handle for its lifetime, so the
+// connection to the server (and its DNS lookup) is reused from one fetch
+// to the next instead of set up for every request. The response buffer
+// is reused as well.
+//
+// Every fetch is counted under "fetch.<name>.": requests, failures,
+// bytes, connects (new connections opened) and latency_ms of the last
+// request. Calls are serialized; use one fetcher per stream of requests
+// that should not wait for each other.
+class http_fetcher : boost::noncopyable
+{
+public:
+    // Takes the chunks of a streamed response; false stops the transfer.
+    typedef boost::function< bool ( char const *, size_t ) > chunk_handler;
+
+    // A timeout of 0 lets transfers take as long as they need.
+    http_fetcher ( string const& name, long timeout = 0 );
+    ~http_fetcher();
+
+    // Fetches into the buffer returned by data().
+    bool fetch ( string const & );
+    vector< char > const& data() const { return buffer_; }
+
+    // Fetches into memory and writes the file with a single write.
+    bool fetch_to ( string const &, path const & );
+
+    // Streams the response to the file; for responses too large to hold.
+    bool download ( string const &, path const & );
+
+    // Hands the response to the handler as it arrives, until the server
+    // ends it, it stalls for stall_timeout seconds, or the handler stops
+    // it; for endless responses such as an MJPEG stream.
+    bool stream ( string const &, chunk_handler const &, long stall_timeout = 30 );
+
+private:
+    bool perform ( string const &, curl_write_callback, void * );
+    static size_t buffer_callback ( char *, size_t, size_t, void * );
+    static size_t file_callback ( char *, size_t, size_t, void * );
+    static size_t stream_callback ( char *, size_t, size_t, void * );
+
+private:
+    string name_;
+    CURL* curl_;
+    vector< char > buffer_;
+    boost::mutex mutex_;
+};
+
+}
+
+#endif
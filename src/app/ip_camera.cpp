@@ -1,5 +1,6 @@
 #include "ip_camera.hpp"
 #include "common.hpp"
+#include "database.hpp"
 #include "global.hpp"
 
 #include "corecomm/DeviceManagementService.h"
@@ -59,18 +60,20 @@ ip_camera::start()
     jpeg_url_ = get_stream_url ( "http/jpeg" );
 
     online_check_timer_.expires_from_now ( seconds ( online_check_interval_) );
-    online_check_timer_.async_wait ( boost::bind ( &ip_camera::online_check, this ) );
-
-    io_service_thread_ = boost::thread ( boost::bind ( &asio::io_service::run, &io_service_ ) );
-
+    online_check_timer_.async_wait ( strand_.wrap ( boost::bind ( &ip_camera::online_check, this, asio::placeholders::error ) ) );
 }
 
 void
 ip_camera::stop()
 {
     LOG ( INFO ) << "ip_camera [" << name_ << "]: stopping...";
-    io_service_.stop();
-    io_service_thread_.join();
+    strand_.post ( [ this ] {
+        boost::system::error_code ec;
+        stopped_ = true;
+        online_check_timer_.cancel ( ec );
+        online_check_resolver_.cancel();
+        online_check_socket_.close ( ec );
+    } );
 }
 
 void
@@ -311,45 +314,77 @@ ip_camera::get_stream_url ( string const& stream_type = "http/mjpeg" )
 }
 
 void
-ip_camera::online_check()
+ip_camera::online_check ( boost::system::error_code const& error )
 {
-    LOG ( INFO ) << "Checking camera for availability...";
+    // Cancelled by stop(): do not reconnect.
+    if ( error == asio::error::operation_aborted || stopped_ )
+        return;
 
-    tcp::resolver resolver ( io_service_ );
-    auto endpoint_iterator = resolver.resolve ( { host_, port_ } );
+    LOG ( INFO ) << "Checking camera for availability...";
 
-    asio::async_connect ( online_check_socket_, endpoint_iterator,
-        [ this ] ( boost::system::error_code ec, tcp::resolver::iterator connected_iterator )
+    online_check_resolver_.async_resolve ( tcp::resolver::query ( host_, port_ ), strand_.wrap (
+        [ this ] ( boost::system::error_code ec, tcp::resolver::iterator endpoint_iterator )
         {
-            if ( !ec )
-            {
-                LOG ( WARNING ) << "ip_camera [" << name_ << "]: is online.";
-            }
-            else
-            {
-                LOG ( WARNING ) << "ip_camera [" << name_ << "]: is offline.";
-            }
-            online_check_socket_.close();
-
-            auto sql = global::get_database_handle();
-            ptime now = microsec_clock::universal_time();
-            ostringstream insert_stmt;
-            insert_stmt << "INSERT INTO uploads VALUES (NULL,"
-            << "'" << common::get_utc_string ( now ) << "',"
-            << "'health',"
-            << "'" << name_ << "',"
-            << "'" << name_ << "',"
-            << "'" << (!ec ? "online" : "offline") << "', 0)";
-            int error = sqlite3_exec ( sql, insert_stmt.str().c_str(), 0, 0, 0 );
-            if ( error )
+            if ( stopped_ )
+                return;
+
+            // A host that does not resolve counts as offline.
+            if ( ec )
             {
-                LOG ( INFO ) << "Could not insert upload in database.";
+                online_check_done ( ec );
+                return;
             }
 
-            online_check_timer_.expires_from_now ( seconds ( online_check_interval_ ) );
-            online_check_timer_.async_wait ( boost::bind ( &ip_camera::online_check, this ) );
+            asio::async_connect ( online_check_socket_, endpoint_iterator, strand_.wrap (
+                [ this ] ( boost::system::error_code ec, tcp::resolver::iterator connected_iterator )
+                {
+                    // The socket was closed by stop(); this is not the camera
+                    // going offline.
+                    if ( stopped_ )
+                        return;
+
+                    online_check_done ( ec );
+                } ) );
+        } ) );
+}
+
+void
+ip_camera::online_check_done ( boost::system::error_code const& ec )
+{
+    if ( !ec )
+    {
+        LOG ( WARNING ) << "ip_camera [" << name_ << "]: is online.";
+    }
+    else
+    {
+        LOG ( WARNING ) << "ip_camera [" << name_ << "]: is offline.";
+    }
+    boost::system::error_code ignored;
+    online_check_socket_.close ( ignored );
+
+    ptime now = microsec_clock::universal_time();
+    auto ts = common::get_utc_string ( now );
+    auto name = name_;
+    string health = !ec ? "online" : "offline";
+    submit_write ( [ ts, name, health ] {
+        statement insert ( "INSERT INTO uploads"
+            " (timestamp, type, reporter, device, upload_file, uploaded)"
+            " VALUES (?, 'health', ?, ?, ?, 0)" );
+        insert.bind ( 1, ts )
+              .bind ( 2, name )
+              .bind ( 3, name )
+              .bind ( 4, health );
+        if ( !insert.exec() )
+        {
+            LOG ( INFO ) << "Could not insert upload in database.";
+            return false;
         }
-        );
+        changed ( "uploads" );
+        return true;
+    } );
+
+    online_check_timer_.expires_from_now ( seconds ( online_check_interval_ ) );
+    online_check_timer_.async_wait ( strand_.wrap ( boost::bind ( &ip_camera::online_check, this, asio::placeholders::error ) ) );
 }
 
 vector< string >
@@ -2,6 +2,7 @@
 #define IP_CAMERA_HPP
 
 #include "device.hpp"
+#include "executor.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -41,8 +42,12 @@ class ip_camera : public device
 {
 public:
     ip_camera ( string const& name ) : device ( name ),
+        io_service_ ( shared_io_service() ),
+        strand_ ( io_service_ ),
         online_check_timer_ ( io_service_ ),
-        online_check_socket_ ( io_service_ ) {}
+        online_check_resolver_ ( io_service_ ),
+        online_check_socket_ ( io_service_ ),
+        stopped_ ( false ) {}
     ~ip_camera() {}
 
     string desc() const override;
@@ -60,7 +65,8 @@ public:
     vector< string > list_video_urls_between ( ptime const &, ptime const &);
 
 private:
-    void online_check();
+    void online_check ( boost::system::error_code const & );
+    void online_check_done ( boost::system::error_code const & );
     bool is_registered_with_core();
     void register_with_core();
     void update_with_core();
@@ -76,10 +82,12 @@ protected:
     string jpeg_url_;
     size_t online_check_interval_;
 
-    asio::io_service io_service_;
-    boost::thread io_service_thread_;
+    asio::io_service& io_service_;
+    asio::io_service::strand strand_;
     asio::deadline_timer online_check_timer_;
+    tcp::resolver online_check_resolver_;
     tcp::socket online_check_socket_;
+    bool stopped_;  // only touched on strand_
 
 };
 
@@ -1,8 +1,8 @@
 #include "common.hpp"
+#include "database.hpp"
 #include "global.hpp"
 #include "loitering.hpp"
 
-#include <curl/curl.h>
 #include <glog/logging.h>
 #include <pstream.h>
 
@@ -10,6 +10,7 @@
 #include <boost/make_shared.hpp>
 #include <boost/chrono.hpp>
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
@@ -43,45 +44,137 @@ loitering::start()
     snapshot_interval_ = parameters_.get ( "snapshot_interval", 60 );
     snapshot_url_ = camera_->jpeg_url();
 
-    snapshot_timer_.expires_from_now ( seconds ( snapshot_interval_) );
-    snapshot_timer_.async_wait ( boost::bind ( &loitering::snapshot, this ) );
+    // One connection per stream, kept open between fetches. Videos are
+    // fetched for events while snapshots go on, so they get their own.
+    snapshot_fetcher_.reset ( new http_fetcher ( name_ + ".snapshot",
+        parameters_.get ( "snapshot_timeout", 10L ) ) );
+    video_fetcher_.reset ( new http_fetcher ( name_ + ".video" ) );
 
-    io_service_thread_ = boost::thread ( boost::bind ( &asio::io_service::run, &io_service_ ) );
+    // Snapshots go to a file each, or with "segments" are appended to
+    // hourly segment files and only written out for events.
+    auto storage = parameters_.get< string > ( "snapshot_storage", "files" );
+    if ( storage == "segments" )
+    {
+        segment_retention_hours_ = parameters_.get ( "segment_retention_hours", 48 );
+        segments_.reset ( new segment_store ( snapshot_dir_ ) );
+        segments_->open();
+    }
+    else
+    {
+        // Index what earlier runs left behind before adding to it.
+        index_for ( camera_->name() );
+    }
+
+    // With "memory" the recent frames are kept in a ring and only written
+    // to disk around a violation.
+    if ( storage == "memory" )
+    {
+        // Reports widen these through event_window() as they start.
+        pre_event_period_ = parameters_.get ( "pre_event_period", 300 );
+        post_event_period_ = parameters_.get ( "post_event_period", 300 );
+        auto megabytes = parameters_.get< size_t > ( "pre_event_memory", 16 );
+        ring_.reset ( new frame_ring ( ring_frames(), megabytes << 20 ) );
+    }
 
+    // With "stream" the snapshots are taken from the camera's MJPEG
+    // stream, which is read once and relayed locally to the vca process,
+    // instead of polling the JPEG URL on a connection of its own.
+    if ( parameters_.get< string > ( "snapshot_source", "poll" ) == "stream" )
+    {
+        relay_.reset ( new mjpeg_relay ( io_service_, name_ ) );
+        relay_->listen ( parameters_.get< unsigned short > ( "relay_port", 0 ) );
+        stream_fetcher_.reset ( new http_fetcher ( name_ + ".stream" ) );
+        demuxer_.reset ( new mjpeg_demuxer ( [ this ] ( char const* data, size_t size ) {
+            on_frame ( data, size );
+        } ) );
+        next_snapshot_ = microsec_clock::universal_time() + seconds ( snapshot_interval_ );
+        fetch_thread_ = boost::thread ( boost::bind ( &loitering::read_stream, this ) );
+    }
+    else
+    {
+        fetch_thread_ = boost::thread ( boost::bind ( &loitering::poll_snapshots, this ) );
+    }
+
+    // Reading the vca output blocks, so it keeps a thread of its own.
     main_thread_ = boost::thread ( boost::bind ( &loitering::process, this ) );
 }
 
 void
 loitering::stop()
 {
+    LOG ( INFO ) << "loitering [" << name_ << "]: stopping...";
 
+    // The stream handler ends the transfer on its next chunk, or the
+    // stall timeout does; a thread waiting to reconnect or for the next
+    // poll is interrupted.
+    stopping_ = true;
+    if ( fetch_thread_.joinable() )
+    {
+        fetch_thread_.interrupt();
+        fetch_thread_.join();
+    }
+    if ( relay_ )
+        relay_->close();
 }
 
 vector< path >
 loitering::list_snapshots_between ( string const& camera, ptime const& from, ptime const& to )
 {
-    vector< path > results;
-    directory_iterator end_iter;
+    return index_for ( camera ).between ( from, to );
+}
+
+vector< path >
+loitering::export_snapshots_between ( string const& camera, ptime const& from, ptime const& to,
+                                     path const& dir )
+{
+    if ( segments_ && camera == camera_->name() )
+        return segments_->export_between ( from, to, dir );
 
-    path search_path = working_dir_ / camera;
+    return list_snapshots_between ( camera, from, to );
+}
 
-    if ( !exists ( search_path ) || !is_directory ( search_path ) )
-        return results;
+void
+loitering::event_window ( time_duration const& pre, time_duration const& post )
+{
+    strand_.post ( [ this, pre, post ] {
+        if ( !ring_ )
+            return;
+
+        int needed_pre = pre.total_seconds();
+        int needed_post = post.total_seconds();
+        if ( needed_pre <= pre_event_period_ && needed_post <= post_event_period_ )
+            return;
+
+        LOG ( WARNING ) << "loitering [" << name_ << "]: event window "
+                        << pre_event_period_ << "s/" << post_event_period_
+                        << "s is shorter than a report needs ("
+                        << needed_pre << "s/" << needed_post << "s), widening it.";
+        pre_event_period_ = std::max ( pre_event_period_, needed_pre );
+        post_event_period_ = std::max ( post_event_period_, needed_post );
+        ring_->resize ( ring_frames() );
+    } );
+}
 
-    for ( directory_iterator dir_iter ( search_path ); dir_iter != end_iter; ++dir_iter )
+size_t
+loitering::ring_frames() const
+{
+    return pre_event_period_ / std::max< size_t > ( snapshot_interval_, 1 ) + 1;
+}
+
+snapshot_index&
+loitering::index_for ( string const& camera )
+{
+    boost::mutex::scoped_lock lock ( indexes_mutex_ );
+
+    auto& index = indexes_[camera];
+    if ( !index )
     {
-        if ( is_regular_file ( dir_iter->status() ) )
-        {
-            string filename = dir_iter->path().filename().string();
-            auto snapshot_time = common::parse_simple_utc_string ( filename );
-            if ( snapshot_time >= from && snapshot_time < to )
-            {
-                results.push_back ( dir_iter->path() );
-            }
-        }
+        // A day of snapshots at one per second.
+        index = make_shared< snapshot_index > ( working_dir_ / camera,
+            parameters_.get< size_t > ( "snapshot_index_size", 86400 ) );
+        index->rebuild();
     }
-
-    return results;
+    return *index;
 }
 
 vector< path >
@@ -96,7 +189,7 @@ loitering::list_videos_between ( string const& camera, ptime const& from, ptime
         {
             path local_file ( url.substr ( url.length() -18 ) );
             path absolute = snapshot_dir_ / local_file;
-            fetch_file ( url, absolute );
+            video_fetcher_->download ( url, absolute );
             videos.push_back ( absolute );
             LOG ( INFO ) << absolute.string();
         }
@@ -110,7 +203,7 @@ loitering::process()
 {
     LOG ( INFO ) << "loitering [" << name_ << "]: main process started.";
 
-    string mjpeg_url = camera_->mjpeg_url();
+    string mjpeg_url = relay_ ? relay_->url() : camera_->mjpeg_url();
 
     ostringstream cmdline;
     cmdline << "vca/vca -i '" << mjpeg_url << "' "
@@ -137,24 +230,32 @@ loitering::process()
                 LOG ( INFO ) << "loitering [" << name_ << "]: violation.";
                 ptime timestamp = microsec_clock::universal_time();
 
-                // Insert event into database.
-                auto sql = global::get_database_handle();
-                int error;
-
-                ostringstream stmt;
-                stmt << "INSERT INTO events VALUES(NULL, "
-                    << "'" << common::get_utc_string ( timestamp ) << "'" << ","
-                    << "'" << type_ << "'" << ","
-                    << "'" << name_ << "'" << ","
-                    << "'" << camera_->name() << "'" << ","
-                    << "'" << line << "'" << ","
-                    << "0" << ")";
-
-                error = sqlite3_exec ( sql, stmt.str().c_str(), 0, 0, 0 );
-                if ( error )
-                {
-                    LOG ( ERROR ) << "Could not register new event with database.";
-                }
+                // Insert event into database. The vca output line is bound
+                // as is, quotes and all.
+                auto evt_ts = common::get_utc_string ( timestamp );
+                auto device = camera_->name();
+                auto type = type_;
+                auto name = name_;
+                submit_write ( [ evt_ts, type, name, device, line ] {
+                    statement insert ( "INSERT INTO events"
+                        " (timestamp, type, reporter, device, description, processed)"
+                        " VALUES (?, ?, ?, ?, ?, 0)" );
+                    insert.bind ( 1, evt_ts )
+                          .bind ( 2, type )
+                          .bind ( 3, name )
+                          .bind ( 4, device )
+                          .bind ( 5, line );
+                    if ( !insert.exec() )
+                    {
+                        LOG ( ERROR ) << "Could not register new event with database.";
+                        return false;
+                    }
+                    changed ( "events" );
+                    return true;
+                } );
+
+                if ( ring_ )
+                    strand_.post ( boost::bind ( &loitering::hold_frames, this, timestamp ) );
                 suspected = false;
             }
         }
@@ -168,17 +269,154 @@ loitering::process()
 }
 
 void
-loitering::snapshot()
+loitering::poll_snapshots()
+{
+    // A fetch can take up to the snapshot timeout, so it runs here rather
+    // than on the shared pool; the frame is handed to the strand.
+    while ( !stopping_ )
+    {
+        boost::this_thread::sleep_for ( boost::chrono::seconds ( snapshot_interval_ ) );
+        if ( stopping_ )
+            break;
+
+        ptime timestamp ( microsec_clock::universal_time() );
+
+        if ( segments_ || ring_ )
+        {
+            auto const& image = snapshot_fetcher_->data();
+            if ( snapshot_fetcher_->fetch ( snapshot_url_ ) && !image.empty() )
+            {
+                auto frame = boost::make_shared< std::vector< char > const > ( image );
+                strand_.post ( boost::bind ( &loitering::store_frame, this, timestamp, frame ) );
+            }
+        }
+        else
+        {
+            path local_file ( common::get_simple_utc_string ( timestamp ) + ".jpg" );
+            path absolute = snapshot_dir_ / local_file;
+
+            LOG ( INFO ) << "loitering [" << name_ << "]: fetching image to " << absolute;
+            if ( snapshot_fetcher_->fetch_to ( snapshot_url_, absolute ) )
+                index_for ( camera_->name() ).add ( absolute );
+        }
+    }
+}
+
+void
+loitering::store_frame ( ptime const& timestamp, frame_ring::image const& image )
+{
+    if ( segments_ )
+    {
+        segments_->append ( timestamp, &( *image )[0], image->size() );
+        segments_->expire_before ( timestamp - hours ( segment_retention_hours_ ) );
+    }
+    else if ( ring_ )
+    {
+        // Frames stay in memory unless an event is holding them.
+        ring_->push ( timestamp, image );
+        if ( timestamp < hold_until_ )
+            write_snapshot ( timestamp, *image );
+        global::stat_set ( "loitering." + name_ + ".ring_frames", ring_->size() );
+        global::stat_set ( "loitering." + name_ + ".ring_bytes", ring_->bytes() );
+
+        // pre_event_memory is too small for the window when the byte bound
+        // pushes frames out before the frame bound does.
+        auto evictions = ring_->byte_evictions();
+        if ( evictions > 0 )
+        {
+            global::stat_set ( "loitering." + name_ + ".ring_byte_evictions", evictions );
+            if ( !byte_cap_warned_ )
+            {
+                LOG ( WARNING ) << "loitering [" << name_ << "]: pre_event_memory holds only "
+                                << ring_->size() << " of " << ring_frames()
+                                << " frame(s) of the " << pre_event_period_
+                                << "s pre-event window, older frames are dropped.";
+                byte_cap_warned_ = true;
+            }
+        }
+    }
+    else
+    {
+        write_snapshot ( timestamp, *image );
+    }
+}
+
+void
+loitering::read_stream()
+{
+    auto url = camera_->mjpeg_url();
+    LOG ( INFO ) << "loitering [" << name_ << "]: reading frames from " << url;
+
+    while ( !stopping_ )
+    {
+        demuxer_->reset();
+        stream_fetcher_->stream ( url, [ this ] ( char const* data, size_t size ) {
+            if ( stopping_ )
+                return false;
+            demuxer_->feed ( data, size );
+            return true;
+        } );
+        if ( stopping_ )
+            break;
+
+        LOG ( WARNING ) << "loitering [" << name_ << "]: stream ended, reconnecting.";
+        boost::this_thread::sleep_for ( boost::chrono::seconds ( 5 ) );
+    }
+}
+
+void
+loitering::on_frame ( char const* data, size_t size )
 {
-    ptime timestamp ( microsec_clock::universal_time() );
-    path local_file ( common::get_simple_utc_string ( timestamp ) + ".jpg" );
-    path absolute = snapshot_dir_ / local_file;
+    relay_->publish ( data, size );
 
-    LOG ( INFO ) << "loitering [" << name_ << "]: fetching image to " << absolute;
-    fetch_file ( snapshot_url_, absolute );
+    // Only the frames kept as snapshots are copied out of the stream.
+    auto now = microsec_clock::universal_time();
+    if ( now < next_snapshot_ )
+        return;
+    next_snapshot_ = now + seconds ( snapshot_interval_ );
 
-    snapshot_timer_.expires_from_now ( seconds ( snapshot_interval_) );
-    snapshot_timer_.async_wait ( boost::bind ( &loitering::snapshot, this ) );
+    global::stat_set ( "loitering." + name_ + ".stream_frames", demuxer_->frames() );
+    global::stat_set ( "loitering." + name_ + ".stream_skipped", demuxer_->skipped() );
+
+    auto image = boost::make_shared< std::vector< char > const > ( data, data + size );
+    strand_.post ( boost::bind ( &loitering::store_frame, this, now, image ) );
+}
+
+void
+loitering::hold_frames ( ptime const& evt_time )
+{
+    // Write the pre-event window out of memory now, and keep writing
+    // frames as they come until the post-event window has passed.
+    hold_until_ = evt_time + seconds ( post_event_period_ );
+
+    auto frozen = ring_->between ( evt_time - seconds ( pre_event_period_ ), hold_until_ );
+    LOG ( INFO ) << "loitering [" << name_ << "]: holding " << frozen.size()
+                 << " frame(s) from memory for event at " << evt_time;
+
+    BOOST_FOREACH ( auto const& f, frozen )
+    {
+        write_snapshot ( f.time, *f.data );
+    }
+}
+
+void
+loitering::write_snapshot ( ptime const& timestamp, std::vector< char > const& image )
+{
+    // Overlapping events hold the same frames; write each once.
+    if ( timestamp <= written_until_ )
+        return;
+
+    path absolute = snapshot_dir_ / ( common::get_simple_utc_string ( timestamp ) + ".jpg" );
+    ofstream ofs ( absolute.string(), ofstream::binary | ofstream::trunc );
+    ofs.write ( &image[0], image.size() );
+    if ( !ofs )
+    {
+        LOG ( ERROR ) << "loitering [" << name_ << "]: cannot write " << absolute;
+        return;
+    }
+
+    written_until_ = timestamp;
+    index_for ( camera_->name() ).add ( absolute );
 }
 
 void
@@ -200,31 +438,4 @@ loitering::cleanup()
     //}
 }
 
-void
-loitering::fetch_file ( string const& url, path const& local_path )
-{
-    ofstream* ofs = new ofstream ( local_path.string(), ofstream::binary | ofstream::trunc );
-    auto curl = curl_easy_init();
-    CURLcode curl_error;
-
-    if ( ofs != NULL && curl != NULL )
-    {
-        curl_easy_setopt ( curl, CURLOPT_URL, url.c_str() );
-        curl_easy_setopt ( curl, CURLOPT_WRITEFUNCTION, &loitering::fetch_file_callback );
-        curl_easy_setopt ( curl, CURLOPT_WRITEDATA, ofs );
-        curl_error = curl_easy_perform ( curl );
-        curl_easy_cleanup ( curl );
-        ofs->close();
-    }
-}
-
-size_t
-loitering::fetch_file_callback ( void* ptr, size_t size, size_t nmemb, void* userdata )
-{
-    auto realsize = size * nmemb;
-    auto ofs = ( ofstream* ) userdata;
-    ofs->write ( ( const char* ) ptr, realsize );
-    return realsize;
-}
-
 }
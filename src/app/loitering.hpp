@@ -2,15 +2,25 @@
 #define LOITERING_HPP
 
 #include "analysis.hpp"
+#include "executor.hpp"
+#include "frame_ring.hpp"
+#include "http_fetcher.hpp"
 #include "ip_camera.hpp"
+#include "mjpeg_demuxer.hpp"
+#include "mjpeg_relay.hpp"
+#include "segment_store.hpp"
+#include "snapshot_index.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/posix_time/posix_time_io.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include <atomic>
+#include <map>
 #include <string>
 
 namespace app
@@ -26,7 +36,12 @@ class loitering : public analysis
 {
 public:
     loitering ( string const& name )
-        : analysis ( name ), snapshot_timer_ ( io_service_ )
+        : analysis ( name ), io_service_ ( shared_io_service() ),
+          strand_ ( io_service_ ),
+          stopping_ ( false ),
+          hold_until_ ( boost::date_time::min_date_time ),
+          written_until_ ( boost::date_time::min_date_time ),
+          byte_cap_warned_ ( false )
     {}
     ~loitering() {}
 
@@ -37,25 +52,54 @@ public:
     shared_ptr< ip_camera > camera() const { return camera_; }
     void camera ( shared_ptr< ip_camera > value ) { camera_ = value; }
     vector< path > list_snapshots_between ( string const &, ptime const &, ptime const & );
+    // Snapshots of the range as files in dir. Stored files are returned
+    // where they are; frames kept in segments are written out to dir.
+    vector< path > export_snapshots_between ( string const &, ptime const &, ptime const &, path const & );
+    // A report says how much of the stream it needs around an event; in
+    // memory mode the ring and the hold are widened to cover it.
+    void event_window ( time_duration const &, time_duration const & );
     vector< path > list_videos_between ( string const &, ptime const &, ptime const & );
 
 private:
     void process();
-    void snapshot();
+    void poll_snapshots();
+    void store_frame ( ptime const &, frame_ring::image const & );
+    void read_stream();
+    void on_frame ( char const *, size_t );
     void cleanup();
-    void fetch_file ( string const &, path const & );
-    static size_t fetch_file_callback ( void *, size_t, size_t, void * );
+    void hold_frames ( ptime const & );
+    size_t ring_frames() const;
+    void write_snapshot ( ptime const &, std::vector< char > const & );
+    snapshot_index& index_for ( string const & );
 
 private:
     shared_ptr< ip_camera > camera_;
     path working_dir_;
     boost::thread main_thread_;
-    boost::thread io_service_thread_;
-    asio::io_service io_service_;
-    asio::deadline_timer snapshot_timer_;
+    asio::io_service& io_service_;
+    asio::io_service::strand strand_;
     path snapshot_dir_;
     size_t snapshot_interval_;
     string snapshot_url_;
+    boost::scoped_ptr< http_fetcher > snapshot_fetcher_;
+    boost::scoped_ptr< http_fetcher > video_fetcher_;
+    boost::scoped_ptr< http_fetcher > stream_fetcher_;
+    boost::scoped_ptr< mjpeg_demuxer > demuxer_;
+    boost::scoped_ptr< mjpeg_relay > relay_;
+    // Fetches block, so polling and stream reading stay off the pool.
+    boost::thread fetch_thread_;
+    std::atomic< bool > stopping_;
+    ptime next_snapshot_;
+    boost::mutex indexes_mutex_;
+    std::map< string, shared_ptr< snapshot_index > > indexes_;
+    boost::scoped_ptr< segment_store > segments_;
+    int segment_retention_hours_;
+    boost::scoped_ptr< frame_ring > ring_;
+    int pre_event_period_;
+    int post_event_period_;
+    ptime hold_until_;
+    ptime written_until_;
+    bool byte_cap_warned_;
 };
 
 }
@@ -1,3 +1,4 @@
+#include "executor.hpp"
 #include "global.hpp"
 
 #include <glog/logging.h>
@@ -22,6 +23,7 @@ int main(int argc, char* argv[])
 
     global::init_libraries();
     global::init_database();
+    app::start_executor(*global::config());
 
     global::qp_init();
 
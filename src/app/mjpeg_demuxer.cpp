@@ -0,0 +1,158 @@
+#include "mjpeg_demuxer.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace app
+{
+
+namespace
+{
+
+char const* find ( char const* begin, char const* end, char const* what, size_t length )
+{
+    auto found = static_cast< char const* > ( memmem ( begin, end - begin, what, length ) );
+    return found ? found : end;
+}
+
+// Content-Length of a part; -1 if its headers have none.
+long content_length ( char const* begin, char const* end )
+{
+    static char const name[] = "content-length:";
+    size_t const length = sizeof ( name ) - 1;
+
+    for ( auto line = begin; line < end; )
+    {
+        auto eol = find ( line, end, "\n", 1 );
+        if ( size_t ( eol - line ) > length
+             && std::equal ( name, name + length, line,
+                    [] ( char a, char b ) { return a == std::tolower ( b ); } ) )
+        {
+            return std::strtol ( string ( line + length, eol ).c_str(), NULL, 10 );
+        }
+        line = eol + 1;
+    }
+    return -1;
+}
+
+}
+
+void
+mjpeg_demuxer::feed ( char const* data, size_t size )
+{
+    if ( buffer_.empty() )
+    {
+        // Frames that lie wholly inside the chunk are handed out from it;
+        // only the tail of a frame still coming is kept.
+        auto used = parse ( data, size );
+        buffer_.assign ( data + used, data + size );
+    }
+    else
+    {
+        buffer_.insert ( buffer_.end(), data, data + size );
+        auto used = parse ( &buffer_[0], buffer_.size() );
+        buffer_.erase ( buffer_.begin(), buffer_.begin() + used );
+    }
+
+    // A part that never ends, or a stream without delimiters.
+    if ( buffer_.size() > max_frame_ + 4096 )
+    {
+        ++skipped_;
+        buffer_.clear();
+    }
+}
+
+void
+mjpeg_demuxer::reset()
+{
+    buffer_.clear();
+    delimiter_.clear();
+}
+
+bool
+mjpeg_demuxer::learn_boundary ( char const* data, size_t size )
+{
+    // The first line starting with "--" is the delimiter.
+    auto end = data + size;
+    for ( auto line = data; line < end; )
+    {
+        auto eol = find ( line, end, "\n", 1 );
+        if ( eol == end )
+            return false;
+        if ( eol - line > 2 && line[0] == '-' && line[1] == '-' )
+        {
+            auto last = eol;
+            while ( last > line && std::isspace ( last[-1] ) )
+                --last;
+            delimiter_.assign ( line, last );
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+size_t
+mjpeg_demuxer::parse ( char const* data, size_t size )
+{
+    if ( delimiter_.empty() && !learn_boundary ( data, size ) )
+        return 0;
+
+    auto end = data + size;
+    auto delimiter = delimiter_.data();
+    auto delimiter_size = delimiter_.size();
+    auto pos = data;
+
+    while ( pos < end )
+    {
+        auto part = find ( pos, end, delimiter, delimiter_size );
+        if ( part == end )
+        {
+            // Keep what could be the start of a delimiter.
+            return std::max ( pos, end - std::min< size_t > ( end - pos, delimiter_size - 1 ) ) - data;
+        }
+
+        auto headers_end = find ( part, end, "\r\n\r\n", 4 );
+        if ( headers_end == end )
+            return part - data;
+
+        auto body = headers_end + 4;
+        auto length = content_length ( part, headers_end );
+        char const* body_end;
+        char const* next;
+
+        if ( length >= 0 )
+        {
+            if ( length > end - body )
+                return part - data;
+            body_end = body + length;
+            next = body_end;
+        }
+        else
+        {
+            next = find ( body, end, delimiter, delimiter_size );
+            if ( next == end )
+                return part - data;
+            body_end = next;
+            while ( body_end > body && ( body_end[-1] == '\n' || body_end[-1] == '\r' ) )
+                --body_end;
+        }
+
+        if ( size_t ( body_end - body ) > max_frame_ )
+        {
+            ++skipped_;
+        }
+        else if ( body_end > body )
+        {
+            ++frames_;
+            handler_ ( body, body_end - body );
+        }
+        pos = next;
+    }
+
+    return pos - data;
+}
+
+}
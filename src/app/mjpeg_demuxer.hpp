@@ -0,0 +1,59 @@
+#ifndef MJPEG_DEMUXER_HPP
+#define MJPEG_DEMUXER_HPP
+
+#include <boost/function.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using std::string;
+using std::vector;
+
+// Splits a multipart/x-mixed-replace MJPEG stream into JPEG frames. The
+// stream is fed in chunks as it arrives; each complete part is handed to
+// the frame handler as a pointer into the chunk, or into the buffer that
+// reassembles parts spanning several chunks, so frames are not copied on
+// the way. The pointer is only valid during the call.
+//
+// The boundary is learnt from the first delimiter line in the stream,
+// since cameras do not always send the one their Content-Type names.
+// Parts are delimited by their Content-Length when they have one and by
+// the next boundary otherwise.
+class mjpeg_demuxer : boost::noncopyable
+{
+public:
+    typedef boost::function< void ( char const *, size_t ) > frame_handler;
+
+    // Parts bigger than max_frame are skipped.
+    mjpeg_demuxer ( frame_handler const& handler, size_t max_frame = 4 << 20 )
+        : handler_ ( handler ), max_frame_ ( max_frame ), frames_ ( 0 ), skipped_ ( 0 ) {}
+    ~mjpeg_demuxer() {}
+
+    void feed ( char const *, size_t );
+
+    // Forgets a partial frame and the boundary, for a new connection.
+    void reset();
+
+    size_t frames() const { return frames_; }
+    size_t skipped() const { return skipped_; }
+
+private:
+    size_t parse ( char const *, size_t );
+    bool learn_boundary ( char const *, size_t );
+
+private:
+    frame_handler handler_;
+    size_t max_frame_;
+    string delimiter_;
+    vector< char > buffer_;
+    size_t frames_;
+    size_t skipped_;
+};
+
+}
+
+#endif
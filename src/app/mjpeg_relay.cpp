@@ -0,0 +1,210 @@
+#include "global.hpp"
+#include "mjpeg_relay.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+namespace app
+{
+
+namespace
+{
+
+char const boundary[] = "--mjpegframe";
+
+}
+
+mjpeg_relay::mjpeg_relay ( asio::io_service& io_service, string const& name )
+    : name_ ( name ), io_service_ ( io_service ), strand_ ( io_service ),
+      acceptor_ ( io_service ), accept_timer_ ( io_service ), port_ ( 0 )
+{
+}
+
+mjpeg_relay::~mjpeg_relay()
+{
+}
+
+unsigned short
+mjpeg_relay::listen ( unsigned short port )
+{
+    tcp::endpoint endpoint ( asio::ip::address_v4::loopback(), port );
+    acceptor_.open ( endpoint.protocol() );
+    acceptor_.set_option ( tcp::acceptor::reuse_address ( true ) );
+    acceptor_.bind ( endpoint );
+    acceptor_.listen();
+    port_ = acceptor_.local_endpoint().port();
+
+    LOG ( INFO ) << "relay [" << name_ << "]: serving on " << url();
+    accept();
+    return port_;
+}
+
+string
+mjpeg_relay::url() const
+{
+    std::ostringstream url;
+    url << "http://127.0.0.1:" << port_ << "/" << name_ << ".mjpeg";
+    return url.str();
+}
+
+void
+mjpeg_relay::close()
+{
+    strand_.post ( [ this ] {
+        boost::system::error_code ec;
+        accept_timer_.cancel ( ec );
+        acceptor_.close ( ec );
+
+        boost::mutex::scoped_lock lock ( mutex_ );
+        BOOST_FOREACH ( auto const& c, clients_ )
+        {
+            c->socket.close ( ec );
+        }
+        clients_.clear();
+    } );
+}
+
+void
+mjpeg_relay::accept()
+{
+    auto c = boost::make_shared< client > ( boost::ref ( io_service_ ) );
+    acceptor_.async_accept ( c->socket,
+        strand_.wrap ( boost::bind ( &mjpeg_relay::on_accept, this, c, asio::placeholders::error ) ) );
+}
+
+void
+mjpeg_relay::on_accept ( shared_ptr< client > c, boost::system::error_code const& ec )
+{
+    if ( ec == asio::error::operation_aborted || !acceptor_.is_open() )
+        return;
+
+    if ( ec )
+    {
+        // Out of descriptors and the like: accepting again right away
+        // would only spin.
+        LOG ( ERROR ) << "relay [" << name_ << "]: accept failed: " << ec.message();
+        global::stat_add ( "relay." + name_ + ".accept_errors", 1 );
+        accept_timer_.expires_from_now ( boost::posix_time::seconds ( 1 ) );
+        accept_timer_.async_wait ( strand_.wrap (
+            boost::bind ( &mjpeg_relay::on_accept_retry, this, asio::placeholders::error ) ) );
+        return;
+    }
+
+    // The request is read and ignored: there is only one stream.
+    asio::async_read_until ( c->socket, c->request, "\r\n\r\n",
+        strand_.wrap ( boost::bind ( &mjpeg_relay::on_request, this, c, asio::placeholders::error ) ) );
+    accept();
+}
+
+void
+mjpeg_relay::on_accept_retry ( boost::system::error_code const& ec )
+{
+    if ( ec == asio::error::operation_aborted || !acceptor_.is_open() )
+        return;
+    accept();
+}
+
+void
+mjpeg_relay::on_request ( shared_ptr< client > c, boost::system::error_code const& ec )
+{
+    if ( ec )
+        return;
+
+    static string const reply = string ( "HTTP/1.0 200 OK\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n"
+        "Content-Type: multipart/x-mixed-replace; boundary=" ) + ( boundary + 2 ) + "\r\n\r\n";
+
+    {
+        boost::mutex::scoped_lock lock ( mutex_ );
+        clients_.push_back ( c );
+        global::stat_set ( "relay." + name_ + ".clients", clients_.size() );
+    }
+    LOG ( INFO ) << "relay [" << name_ << "]: client connected";
+
+    auto header = boost::make_shared< vector< char > > ( reply.begin(), reply.end() );
+    send ( c, header );
+}
+
+void
+mjpeg_relay::publish ( char const* data, size_t size )
+{
+    vector< shared_ptr< client > > ready;
+    {
+        boost::mutex::scoped_lock lock ( mutex_ );
+        BOOST_FOREACH ( auto const& c, clients_ )
+        {
+            if ( c->busy )
+            {
+                global::stat_add ( "relay." + name_ + ".frames_skipped", 1 );
+                continue;
+            }
+            c->busy = true;
+            ready.push_back ( c );
+        }
+    }
+    if ( ready.empty() )
+        return;
+
+    // One copy of the part, shared by every client it goes to.
+    char header[128];
+    int length = std::snprintf ( header, sizeof ( header ),
+        "%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", boundary, size );
+
+    auto part = boost::make_shared< vector< char > >();
+    part->reserve ( length + size + 2 );
+    part->insert ( part->end(), header, header + length );
+    part->insert ( part->end(), data, data + size );
+    part->push_back ( '\r' );
+    part->push_back ( '\n' );
+
+    BOOST_FOREACH ( auto const& c, ready )
+    {
+        strand_.post ( boost::bind ( &mjpeg_relay::send, this, c, part ) );
+    }
+}
+
+void
+mjpeg_relay::send ( shared_ptr< client > c, buffer data )
+{
+    asio::async_write ( c->socket, asio::buffer ( *data ),
+        strand_.wrap ( boost::bind ( &mjpeg_relay::on_sent, this, c, data, asio::placeholders::error ) ) );
+}
+
+void
+mjpeg_relay::on_sent ( shared_ptr< client > c, buffer, boost::system::error_code const& ec )
+{
+    if ( ec )
+    {
+        drop ( c );
+        return;
+    }
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+    c->busy = false;
+}
+
+void
+mjpeg_relay::drop ( shared_ptr< client > c )
+{
+    boost::system::error_code ec;
+    c->socket.close ( ec );
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+    auto it = std::find ( clients_.begin(), clients_.end(), c );
+    if ( it == clients_.end() )
+        return;
+    clients_.erase ( it );
+    global::stat_set ( "relay." + name_ + ".clients", clients_.size() );
+    LOG ( INFO ) << "relay [" << name_ << "]: client disconnected";
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef MJPEG_RELAY_HPP
+#define MJPEG_RELAY_HPP
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+namespace asio = boost::asio;
+using boost::asio::ip::tcp;
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+
+// Serves the frames of a camera as an MJPEG stream on the loopback
+// interface, so local consumers such as the vca process read the frames
+// already coming in instead of opening a stream of their own to the
+// camera. A client that is still sending the last frame skips the new
+// one rather than queueing it, so a slow reader never holds frames back
+// or grows memory.
+//
+// Handlers refer to the relay, so it has to outlive the io_service's
+// pending work; close() stops it.
+class mjpeg_relay : boost::noncopyable
+{
+public:
+    mjpeg_relay ( asio::io_service &, string const& name );
+    ~mjpeg_relay();
+
+    // Listens on 127.0.0.1:port, or on a free port for 0, and returns the
+    // port.
+    unsigned short listen ( unsigned short port );
+
+    // Where clients connect.
+    string url() const;
+
+    // Sends a frame to the clients that are ready for one. Frames are
+    // only copied when there is a client to take them.
+    void publish ( char const *, size_t );
+
+    void close();
+
+private:
+    struct client
+    {
+        client ( asio::io_service& io_service ) : socket ( io_service ), busy ( true ) {}
+        tcp::socket socket;
+        asio::streambuf request;
+        bool busy;
+    };
+
+    typedef shared_ptr< vector< char > > buffer;
+
+    void accept();
+    void on_accept ( shared_ptr< client >, boost::system::error_code const & );
+    void on_accept_retry ( boost::system::error_code const & );
+    void on_request ( shared_ptr< client >, boost::system::error_code const & );
+    void send ( shared_ptr< client >, buffer );
+    void on_sent ( shared_ptr< client >, buffer, boost::system::error_code const & );
+    void drop ( shared_ptr< client > );
+
+private:
+    string name_;
+    asio::io_service& io_service_;
+    asio::io_service::strand strand_;
+    tcp::acceptor acceptor_;
+    asio::deadline_timer accept_timer_;
+    unsigned short port_;
+    boost::mutex mutex_;
+    vector< shared_ptr< client > > clients_;
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "notifier.hpp"
+#include "global.hpp"
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <vector>
+
+namespace app
+{
+
+using std::vector;
+
+namespace
+{
+
+struct subscription
+{
+    int id;
+    string table;
+    change_listener listener;
+};
+
+boost::mutex subscriptions_mutex;
+vector< subscription > subscriptions;
+int next_id = 1;
+
+}
+
+int
+subscribe_changes ( string const& table, change_listener listener )
+{
+    boost::mutex::scoped_lock lock ( subscriptions_mutex );
+
+    subscription s;
+    s.id = next_id++;
+    s.table = table;
+    s.listener = listener;
+    subscriptions.push_back ( s );
+
+    return s.id;
+}
+
+void
+unsubscribe_changes ( int id )
+{
+    boost::mutex::scoped_lock lock ( subscriptions_mutex );
+
+    for ( auto it = subscriptions.begin(); it != subscriptions.end(); ++it )
+    {
+        if ( it->id == id )
+        {
+            subscriptions.erase ( it );
+            break;
+        }
+    }
+}
+
+void
+notify_change ( string const& table )
+{
+    // Call the listeners outside the lock so that one may subscribe or
+    // unsubscribe from inside its callback.
+    vector< change_listener > listeners;
+    {
+        boost::mutex::scoped_lock lock ( subscriptions_mutex );
+        BOOST_FOREACH ( auto const& s, subscriptions )
+        {
+            if ( s.table == table )
+                listeners.push_back ( s.listener );
+        }
+    }
+
+    global::stat_add ( "notify." + table, 1 );
+
+    BOOST_FOREACH ( auto const& listener, listeners )
+    {
+        listener();
+    }
+}
+
+}
@@ -0,0 +1,25 @@
+#ifndef NOTIFIER_HPP
+#define NOTIFIER_HPP
+
+#include <boost/function.hpp>
+
+#include <string>
+
+namespace app
+{
+
+using std::string;
+
+// In-process change notifications keyed by table name. Code that adds
+// work to a table raises it, and consumers subscribe instead of polling.
+// Listeners run on the notifying thread, so they should only hand the
+// wakeup over to their own thread (post an event, cancel a timer).
+typedef boost::function< void() > change_listener;
+
+int subscribe_changes ( string const& table, change_listener );
+void unsubscribe_changes ( int );
+void notify_change ( string const& table );
+
+}
+
+#endif
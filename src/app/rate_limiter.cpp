@@ -0,0 +1,142 @@
+#include "rate_limiter.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+
+namespace app
+{
+
+using boost::chrono::steady_clock;
+
+void
+token_bucket::configure ( double rate, double burst )
+{
+    rate_ = rate;
+    burst_ = std::max ( burst, rate );
+    tokens_ = std::min ( tokens_, burst_ );
+    last_ = steady_clock::now();
+}
+
+void
+token_bucket::refill()
+{
+    auto now = steady_clock::now();
+    double elapsed = boost::chrono::duration< double > ( now - last_ ).count();
+    tokens_ = std::min ( burst_, tokens_ + elapsed * rate_ );
+    last_ = now;
+}
+
+size_t
+token_bucket::take ( size_t wanted )
+{
+    if ( unlimited() )
+        return wanted;
+
+    refill();
+    size_t granted = std::min ( wanted, static_cast< size_t > ( tokens_ ) );
+    tokens_ -= granted;
+    return granted;
+}
+
+void
+token_bucket::put_back ( size_t unused )
+{
+    if ( !unlimited() )
+        tokens_ = std::min ( burst_, tokens_ + unused );
+}
+
+void
+rate_limiter::load ( ptree const& config )
+{
+    default_rate_ = config.get ( "upload.max_rate", 0.0 );
+    burst_seconds_ = config.get ( "upload.burst_seconds", 1.0 );
+
+    BOOST_FOREACH ( ptree::value_type const& section, config )
+    {
+        string name ( section.first.data() );
+
+        if ( name.find ( "upload-class-" ) == 0 )
+        {
+            auto type = name.substr ( string ( "upload-class-" ).length() );
+            auto rate = section.second.get ( "max_rate", 0.0 );
+            per_type_[type].configure ( rate, rate * burst_seconds_ );
+        }
+        else if ( name.find ( "upload-window-" ) == 0 )
+        {
+            upload_window window;
+            window.name = name.substr ( string ( "upload-window-" ).length() );
+            window.start = section.second.get ( "start", 0 );
+            window.end = section.second.get ( "end", 0 );
+            window.max_rate = section.second.get ( "max_rate", 0.0 );
+            windows_.push_back ( window );
+
+            LOG ( INFO ) << "upload window: " << window.name
+                         << " " << window.start << "h-" << window.end << "h"
+                         << " max_rate: " << window.max_rate;
+        }
+    }
+
+    global_.configure ( default_rate_, default_rate_ * burst_seconds_ );
+    current_window_ = -1;
+    window_checked_ = steady_clock::now();
+    update_window();
+}
+
+void
+rate_limiter::update_window()
+{
+    int hour = boost::posix_time::second_clock::local_time().time_of_day().hours();
+    int matched = -1;
+
+    for ( size_t i = 0; i < windows_.size() && matched < 0; ++i )
+    {
+        auto const& w = windows_[i];
+        bool inside = w.start <= w.end
+            ? ( hour >= w.start && hour < w.end )
+            : ( hour >= w.start || hour < w.end );
+        if ( inside )
+            matched = i;
+    }
+
+    if ( matched != current_window_ )
+    {
+        double rate = matched < 0 ? default_rate_ : windows_[matched].max_rate;
+        global_.configure ( rate, rate * burst_seconds_ );
+        current_window_ = matched;
+
+        LOG ( INFO ) << "Upload rate limit now "
+                     << ( rate > 0 ? rate : 0 ) << " bytes/s"
+                     << ( matched < 0 ? "" : " (window " + windows_[matched].name + ")" );
+    }
+}
+
+size_t
+rate_limiter::acquire ( string const& type, size_t wanted )
+{
+    auto now = steady_clock::now();
+    if ( now - window_checked_ >= boost::chrono::seconds ( 60 ) )
+    {
+        window_checked_ = now;
+        update_window();
+    }
+
+    // Take from the type bucket first so that a type at its own cap does
+    // not consume global tokens that another type could use, and return
+    // whatever the global bucket could not cover.
+    auto it = per_type_.find ( type );
+    size_t granted = it != per_type_.end() ? it->second.take ( wanted ) : wanted;
+    if ( granted == 0 )
+        return 0;
+
+    size_t allowed = global_.take ( granted );
+    if ( it != per_type_.end() )
+        it->second.put_back ( granted - allowed );
+
+    return allowed;
+}
+
+}
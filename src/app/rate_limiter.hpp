@@ -0,0 +1,82 @@
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <boost/chrono.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/utility.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using boost::property_tree::ptree;
+using std::map;
+using std::string;
+using std::vector;
+
+// Classic token bucket in bytes. A rate of zero means unlimited.
+class token_bucket
+{
+public:
+    token_bucket() : rate_ ( 0 ), burst_ ( 0 ), tokens_ ( 0 ) {}
+
+    void configure ( double rate, double burst );
+    bool unlimited() const { return rate_ <= 0; }
+    size_t take ( size_t );
+    void put_back ( size_t );
+    double rate() const { return rate_; }
+
+private:
+    void refill();
+
+private:
+    double rate_;
+    double burst_;
+    double tokens_;
+    boost::chrono::steady_clock::time_point last_;
+};
+
+// Upload time-of-day window read from an [upload-window-<name>] section,
+// e.g. a higher cap at night. Hours are local time; a window whose start
+// is after its end wraps around midnight.
+struct upload_window
+{
+    string name;
+    int start;
+    int end;
+    double max_rate;
+};
+
+// Shapes upload bandwidth with one global bucket and one bucket per upload
+// type. The global rate is upload.max_rate unless the current local hour
+// falls in an upload window; per-type rates come from the max_rate key of
+// the [upload-class-<type>] sections. Not thread safe: only the upload
+// engine thread calls acquire().
+class rate_limiter : boost::noncopyable
+{
+public:
+    rate_limiter() : current_window_ ( -1 ) {}
+    ~rate_limiter() {}
+
+    void load ( ptree const & );
+    size_t acquire ( string const &, size_t );
+
+private:
+    void update_window();
+
+private:
+    token_bucket global_;
+    map< string, token_bucket > per_type_;
+    vector< upload_window > windows_;
+    double default_rate_;
+    double burst_seconds_;
+    int current_window_;
+    boost::chrono::steady_clock::time_point window_checked_;
+};
+
+}
+
+#endif
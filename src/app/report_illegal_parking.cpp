@@ -1,16 +1,25 @@
 #include "report_illegal_parking.hpp"
+#include "bundle.hpp"
 #include "common.hpp"
+#include "database.hpp"
 #include "global.hpp"
+#include "notifier.hpp"
+#include "transcoder.hpp"
 
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <map>
 #include <sstream>
 
 namespace app
 {
 
 using namespace boost::posix_time;
+using std::make_pair;
+using std::map;
 using std::ostringstream;
+using std::pair;
 
 void
 report_illegal_parking::start()
@@ -19,12 +28,22 @@ report_illegal_parking::start()
 
     working_dir_ = global::config()->get ( "vca.data_dir", "data" ) /  name_;
     create_directories ( working_dir_ );
+    blobs_.reset ( new blob_store (
+        path ( global::config()->get ( "vca.data_dir", "data" ) ) / "blobs" ) );
 
     pre_event_period_ = seconds ( parameters_.get ( "pre_event_period", 300 ) );
     post_event_period_ = seconds ( parameters_.get ( "post_event_period", 300 ) );
     clip_length_ = seconds ( parameters_.get ( "clip_length", 900 ) );
-    event_check_interval_ = seconds ( 10 );
-    event_check_timer_.expires_from_now ( event_check_interval_ );
+    bundle_ = parameters_.get ( "bundle", false );
+    event_check_interval_ = seconds ( parameters_.get ( "event_check_interval", 60 ) );
+
+    // The loitering analysis has to keep this much around each event.
+    loiter_->event_window ( pre_event_period_, post_event_period_ );
+
+    // New events cut the wait short; the interval is only a safety net.
+    subscribe_changes ( "events", boost::bind ( &report_illegal_parking::events_changed, this ) );
+
+    event_check_timer_.expires_from_now ( seconds ( 0 ) );
     event_check_timer_.async_wait ( boost::bind ( &report_illegal_parking::process_event, this ) );
     io_service_thread_ = boost::thread ( boost::bind ( &asio::io_service::run, &io_service_ ) );
 }
@@ -44,62 +63,87 @@ report_illegal_parking::desc() const
     return description.str();
 }
 
+void
+report_illegal_parking::events_changed()
+{
+    // Cancelling the timer runs process_event right away. The cancel is
+    // posted so that it lands after a check already in progress re-armed
+    // the timer.
+    io_service_.post ( [ this ] {
+        boost::system::error_code ec;
+        event_check_timer_.cancel ( ec );
+    } );
+}
+
 void
 report_illegal_parking::process_event()
 {
-    // Check if there are unprocessed events in the database.
-    auto sql = global::get_database_handle();
-    sqlite3_stmt* stmt;
-    ostringstream query;
-
-    query << "SELECT * FROM events WHERE processed=0"
-        << " and reporter='" << loiter_->name() << "'";
-    auto query_cstr = query.str().c_str();
-    sqlite3_prepare_v2(sql, query_cstr, strlen ( query_cstr ) + 1, &stmt, NULL );
-
-    int retval = sqlite3_step(stmt);
-    if (retval == SQLITE_ROW)
+    // Sleep for the safety interval unless an event is processed or
+    // becomes ready sooner.
+    time_duration next_check = event_check_interval_;
+
+    // Check if there are unprocessed events in the database. The row is
+    // copied out so the query is not held open while the event is built.
+    string evt_id, evt_ts, evt_type, evt_reporter, evt_device;
+    bool found;
     {
-        auto evt_id = string ( reinterpret_cast< const char *> ( sqlite3_column_text ( stmt, 0 ) ) );
-        auto evt_ts = string ( reinterpret_cast< const char *> ( sqlite3_column_text ( stmt, 1 ) ) );
-        auto evt_type = string ( reinterpret_cast< const char *> ( sqlite3_column_text ( stmt, 2 ) ) );
-        auto evt_reporter = string ( reinterpret_cast< const char *> ( sqlite3_column_text ( stmt, 3 ) ) );
-        auto evt_device = string ( reinterpret_cast< const char *> ( sqlite3_column_text ( stmt, 4 ) ) );
+        statement query ( "SELECT * FROM events WHERE processed=0 and reporter=?" );
+        found = query.bind ( 1, loiter_->name() ).step();
+        if ( found )
+        {
+            evt_id = query.column_text ( 0 );
+            evt_ts = query.column_text ( 1 );
+            evt_type = query.column_text ( 2 );
+            evt_reporter = query.column_text ( 3 );
+            evt_device = query.column_text ( 4 );
+        }
+    }
 
+    if ( found )
+    {
         auto evt_time = common::parse_utc_string ( evt_ts );
         auto evt_start_time = evt_time - pre_event_period_;
         auto evt_completion_time = evt_time + post_event_period_;
         auto now = microsec_clock::universal_time();
-        if ( now >= evt_completion_time + clip_length_ )
+        auto evt_ready_time = evt_completion_time + clip_length_;
+        if ( now < evt_ready_time )
+        {
+            next_check = std::min ( next_check, evt_ready_time - now );
+        }
+        else
         {
             LOG ( INFO ) << "Getting snapshots for event: " << evt_id
                         << " start: " << common::get_utc_string ( evt_start_time )
                         << " end: " << common::get_utc_string ( evt_completion_time );
-            auto snapshots = loiter_->list_snapshots_between ( evt_device, evt_start_time, evt_completion_time );
 
             // Create directory for event.
             auto evt_dir = working_dir_ / common::get_simple_utc_string ( evt_time ) / evt_device;
             create_directories ( evt_dir );
 
-            // Copy the snapshots to event directory.
+            // Snapshots kept in segments are written straight to evt_dir.
+            auto snapshots = loiter_->export_snapshots_between ( evt_device, evt_start_time,
+                                                                 evt_completion_time, evt_dir );
+
+            // Link the snapshots into the event directory. Overlapping events
+            // share the stored blob instead of holding copies of their own.
+            vector< path > copies;
+            map< path, string > digests;
             BOOST_FOREACH ( auto const& s, snapshots )
             {
                 auto to = evt_dir / s.filename();
-                copy_file ( s, to, copy_option::overwrite_if_exists );
-
-                // Queue the snapshot for upload.
-                ostringstream insert_stmt;
-                insert_stmt << "INSERT INTO uploads VALUES (NULL,"
-                    << "'" << common::get_utc_string ( evt_time ) << "',"
-                    << "'" << evt_type << "',"
-                    << "'" << evt_reporter << "',"
-                    << "'" << evt_device << "',"
-                    << "'" << to.string() << "', 0)";
-                int error = sqlite3_exec ( sql, insert_stmt.str().c_str(), 0, 0, 0 );
-                if ( error )
-                {
-                    LOG ( INFO ) << "Could not insert upload in database.";
-                }
+                digests[to] = store_evidence ( s, to );
+                copies.push_back ( to );
+            }
+
+            // Shrink the copies for upload when transcoding is enabled.
+            auto snapshot_uploads = get_default_transcoder()->transcode_all ( copies );
+
+            vector< pair< path, string > > evidence;
+            BOOST_FOREACH ( auto const& to, snapshot_uploads )
+            {
+                // Transcoded files are new content and get a digest of their own.
+                auto digest = digests.count ( to ) ? digests[to] : blobs_->add ( to );
+                evidence.push_back ( make_pair ( to, digest ) );
             }
 
             LOG ( INFO ) << "Getting videos for event: " << evt_id
@@ -108,41 +152,137 @@ report_illegal_parking::process_event()
             auto videos = loiter_->list_videos_between ( "",
                     evt_start_time - clip_length_, evt_completion_time + clip_length_ );
 
-            // Copy the videos to event directory.
+            // Link the videos into the event directory.
             BOOST_FOREACH ( auto const& v, videos )
             {
                 auto to = evt_dir / v.filename();
-                copy_file ( v, to, copy_option::overwrite_if_exists );
-
-                // Queue the snapshot for upload.
-                ostringstream insert_stmt;
-                insert_stmt << "INSERT INTO uploads VALUES (NULL,"
-                    << "'" << common::get_utc_string ( evt_time ) << "',"
-                    << "'" << evt_type << "',"
-                    << "'" << evt_reporter << "',"
-                    << "'" << evt_device << "',"
-                    << "'" << to.string() << "', 0)";
-                int error = sqlite3_exec ( sql, insert_stmt.str().c_str(), 0, 0, 0 );
-                if ( error )
+                evidence.push_back ( make_pair ( to, store_evidence ( v, to ) ) );
+            }
+
+            ptree upload;
+            upload.put ( "timestamp", common::get_utc_string ( evt_time ) );
+            upload.put ( "type", evt_type );
+            upload.put ( "reporter", evt_reporter );
+            upload.put ( "device", evt_device );
+
+            // In bundle mode the whole event goes out as one archive; fall
+            // back to one upload per file if the archive cannot be written.
+            bool bundled = false;
+            if ( bundle_ && !evidence.empty() )
+            {
+                auto archive = evt_dir / ( common::get_simple_utc_string ( evt_time ) + ".tar" );
+                event_bundle bundle ( archive );
+                BOOST_FOREACH ( auto const& e, evidence )
                 {
-                    LOG ( INFO ) << "Could not insert upload in database.";
+                    bundle.add ( e.first, e.second );
+                }
+
+                if ( bundle.write ( upload ) )
+                {
+                    auto digest = blobs_->add ( archive );
+                    record_bundle ( digest, evidence );
+                    queue_upload ( upload, archive, digest );
+                    bundled = true;
                 }
             }
 
-            // Update the status of the event.
-            ostringstream update_stmt;
-            update_stmt << "UPDATE events set processed=1 where id=" << evt_id;
-            int error = sqlite3_exec ( sql, update_stmt.str().c_str(), 0, 0, 0 );
-            if ( error )
+            if ( !bundled )
             {
-                LOG ( INFO ) << "Could not update event status in database.";
+                BOOST_FOREACH ( auto const& e, evidence )
+                {
+                    queue_upload ( upload, e.first, e.second );
+                }
             }
+
+            // Update the status of the event. The writer applies it after
+            // the upload rows queued above, and waiting here keeps the next
+            // poll from picking the same event up again.
+            execute_write ( [ evt_id ] {
+                statement update ( "UPDATE events set processed=1 where id=?" );
+                if ( !update.bind ( 1, evt_id ).exec() )
+                {
+                    LOG ( INFO ) << "Could not update event status in database.";
+                    return false;
+                }
+                return true;
+            } );
+
+            // There may be more events ready behind this one.
+            next_check = seconds ( 0 );
         }
     }
-    sqlite3_finalize(stmt);
 
-    event_check_timer_.expires_from_now ( event_check_interval_ );
+    event_check_timer_.expires_from_now ( next_check );
     event_check_timer_.async_wait ( boost::bind ( &report_illegal_parking::process_event, this ) );
 }
 
+void
+report_illegal_parking::queue_upload ( ptree const& upload, path const& file, string const& digest )
+{
+    auto file_name = file.string();
+    submit_write ( [ upload, file_name, digest ] {
+        statement insert ( "INSERT INTO uploads"
+            " (timestamp, type, reporter, device, upload_file, uploaded, digest)"
+            " VALUES (?, ?, ?, ?, ?, 0, ?)" );
+        insert.bind ( 1, upload.get< string > ( "timestamp" ) )
+              .bind ( 2, upload.get< string > ( "type" ) )
+              .bind ( 3, upload.get< string > ( "reporter" ) )
+              .bind ( 4, upload.get< string > ( "device" ) )
+              .bind ( 5, file_name );
+        if ( !digest.empty() )
+            insert.bind ( 6, digest );
+
+        if ( !insert.exec() )
+        {
+            LOG ( INFO ) << "Could not insert upload in database.";
+            return false;
+        }
+        changed ( "uploads" );
+        return true;
+    } );
+}
+
+void
+report_illegal_parking::record_bundle ( string const& bundle,
+                                        vector< pair< path, string > > const& members )
+{
+    if ( bundle.empty() )
+        return;
+
+    vector< string > digests;
+    BOOST_FOREACH ( auto const& m, members )
+    {
+        if ( !m.second.empty() )
+            digests.push_back ( m.second );
+    }
+
+    submit_write ( [ bundle, digests ] {
+        statement insert ( "INSERT OR IGNORE INTO bundle_members (bundle, member) VALUES (?, ?)" );
+        BOOST_FOREACH ( auto const& d, digests )
+        {
+            if ( !insert.bind ( 1, bundle ).bind ( 2, d ).exec() )
+            {
+                LOG ( INFO ) << "Could not record bundle members in database.";
+                return false;
+            }
+        }
+        return true;
+    } );
+}
+
+string
+report_illegal_parking::store_evidence ( path const& from, path const& to )
+{
+    auto digest = blobs_->add ( from );
+    if ( digest.empty() )
+    {
+        if ( from != to )
+            copy_file ( from, to, copy_option::overwrite_if_exists );
+        return digest;
+    }
+
+    blobs_->link ( digest, to );
+    return digest;
+}
+
 }
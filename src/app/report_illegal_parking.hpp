@@ -1,10 +1,12 @@
 #ifndef REPORT_ILLEGAL_PARKING_HPP
 #define REPORT_ILLEGAL_PARKING_HPP
 
+#include "blob_store.hpp"
 #include "loitering.hpp"
 #include "report.hpp"
 
 #include <boost/asio.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
@@ -18,7 +20,7 @@ class report_illegal_parking : public report
 {
 public:
     report_illegal_parking ( string const& name )
-        : report ( name ), event_check_timer_ ( io_service_ ) {}
+        : report ( name ), event_check_timer_ ( io_service_ ), bundle_ ( false ) {}
     ~report_illegal_parking() {}
     void start() override;
     void stop() override;
@@ -28,10 +30,17 @@ public:
     void loiter ( shared_ptr< loitering > loiter ) { loiter_ = loiter; }
 
 private:
+    void events_changed();
     void process_event();
+    string store_evidence ( path const &, path const & );
+    void queue_upload ( ptree const &, path const &, string const & );
+    void record_bundle ( string const &, std::vector< std::pair< path, string > > const & );
 
 private:
     shared_ptr< loitering > loiter_;
+    boost::scoped_ptr< blob_store > blobs_;
+    // Not on the shared executor: processing an event downloads videos,
+    // hashes and transcodes evidence, and would hold up every camera.
     asio::io_service io_service_;
     boost::thread io_service_thread_;
     asio::deadline_timer event_check_timer_;
@@ -39,6 +48,7 @@ private:
     time_duration pre_event_period_;
     time_duration post_event_period_;
     time_duration clip_length_;
+    bool bundle_;
 };
 
 }
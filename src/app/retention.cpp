@@ -0,0 +1,237 @@
+#include "retention.hpp"
+#include "blob_store.hpp"
+#include "database.hpp"
+#include "global.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+namespace app
+{
+
+using namespace boost::posix_time;
+using std::ostringstream;
+using std::vector;
+
+retention::retention ( ptree const& config )
+{
+    enabled_ = config.get ( "retention.enabled", true );
+    max_age_days_ = config.get ( "retention.max_age_days", 30 );
+    max_rows_ = config.get ( "retention.max_rows", 100000LL );
+    batch_size_ = std::max ( config.get ( "retention.batch_size", 500LL ), 1LL );
+    vacuum_pages_ = config.get ( "retention.vacuum_pages", 1000 );
+    interval_ = seconds ( config.get ( "retention.interval", 600 ) );
+    batch_pause_ = milliseconds ( config.get ( "retention.batch_pause", 100 ) );
+    blobs_root_ = boost::filesystem::path ( config.get ( "vca.data_dir", "data" ) ) / "blobs";
+}
+
+void
+retention::start()
+{
+    if ( !enabled_ )
+        return;
+
+    LOG ( INFO ) << "retention: max age " << max_age_days_ << " days"
+                 << " max rows " << max_rows_
+                 << " every " << interval_.total_seconds() << "s";
+
+    thread_ = boost::thread ( boost::bind ( &retention::run, this ) );
+}
+
+void
+retention::run()
+{
+    while ( true )
+    {
+        boost::this_thread::sleep ( interval_ );
+
+        purge ( "uploads", "uploaded=1" );
+        purge ( "events", "processed=1" );
+        purge_blobs();
+        vacuum();
+    }
+}
+
+void
+retention::purge ( string const& table, string const& finished )
+{
+    long long deleted = 0;
+    long long batch;
+
+    // Finished rows past their age, oldest first.
+    if ( max_age_days_ > 0 )
+    {
+        ostringstream age;
+        age << "-" << max_age_days_ << " days";
+
+        auto sql = "DELETE FROM " + table + " WHERE id IN (SELECT id FROM " + table
+                 + " WHERE " + finished + " AND timestamp < datetime('now', ?)"
+                 + " ORDER BY id LIMIT ?)";
+        do
+        {
+            batch = delete_batch ( sql, age.str(), batch_size_ );
+            deleted += batch;
+            boost::this_thread::sleep ( batch_pause_ );
+        }
+        while ( batch == batch_size_ );
+    }
+
+    // Then the oldest finished rows beyond the row cap.
+    if ( max_rows_ > 0 )
+    {
+        auto sql = "DELETE FROM " + table + " WHERE id IN (SELECT id FROM " + table
+                 + " WHERE " + finished + " ORDER BY id LIMIT ?)";
+        auto excess = count_rows ( table ) - max_rows_;
+        while ( excess > 0 )
+        {
+            batch = delete_batch ( sql, "", std::min ( excess, batch_size_ ) );
+            if ( batch == 0 )
+                break;
+            deleted += batch;
+            excess -= batch;
+            boost::this_thread::sleep ( batch_pause_ );
+        }
+    }
+
+    if ( deleted > 0 )
+    {
+        LOG ( INFO ) << "retention: deleted " << deleted << " row(s) from " << table;
+        global::stat_add ( "retention." + table + "_deleted", deleted );
+    }
+}
+
+long long
+retention::delete_batch ( string const& sql, string const& age, long long limit )
+{
+    long long deleted = 0;
+
+    execute_write ( [ &sql, &age, limit, &deleted ] {
+        statement del ( sql );
+        if ( age.empty() )
+            del.bind ( 1, limit );
+        else
+            del.bind ( 1, age ).bind ( 2, limit );
+
+        if ( !del.exec() )
+        {
+            LOG ( ERROR ) << "retention: delete failed: " << del.error();
+            return false;
+        }
+        deleted = del.changes();
+        return true;
+    } );
+
+    return deleted;
+}
+
+long long
+retention::count_rows ( string const& table )
+{
+    statement count ( "SELECT count(*) FROM " + table );
+    return count.step() ? count.column_int64 ( 0 ) : 0;
+}
+
+void
+retention::purge_blobs()
+{
+    blob_store blobs ( blobs_root_ );
+    long long deleted = 0;
+    long long batch;
+
+    // Acknowledged blobs no upload refers to any more. The file goes in the
+    // same write as its row, so the writer never sees a row without a file.
+    do
+    {
+        batch = 0;
+        execute_write ( [ this, &blobs, &batch ] {
+            statement select ( "SELECT digest FROM blobs WHERE uploaded=1 AND NOT EXISTS"
+                " (SELECT 1 FROM uploads WHERE uploads.digest=blobs.digest) LIMIT ?" );
+            select.bind ( 1, batch_size_ );
+            vector< string > digests;
+            while ( select.step() )
+                digests.push_back ( select.column_text ( 0 ) );
+
+            statement del ( "DELETE FROM blobs WHERE digest=?" );
+            statement members ( "DELETE FROM bundle_members WHERE bundle=?" );
+            BOOST_FOREACH ( auto const& digest, digests )
+            {
+                if ( !del.bind ( 1, digest ).exec() || !members.bind ( 1, digest ).exec() )
+                {
+                    LOG ( ERROR ) << "retention: delete failed: " << del.error();
+                    return false;
+                }
+            }
+
+            // Only once every row is gone, so a rolled back job keeps its files.
+            BOOST_FOREACH ( auto const& digest, digests )
+            {
+                boost::system::error_code ec;
+                remove ( blobs.blob_path ( digest ), ec );
+            }
+            batch = digests.size();
+            return true;
+        } );
+
+        deleted += batch;
+        if ( batch > 0 )
+            boost::this_thread::sleep ( batch_pause_ );
+    }
+    while ( batch >= batch_size_ );
+
+    if ( deleted > 0 )
+    {
+        LOG ( INFO ) << "retention: removed " << deleted << " blob(s)";
+        global::stat_add ( "retention.blobs_deleted", deleted );
+    }
+}
+
+void
+retention::vacuum()
+{
+    long long reclaimed = 0;
+
+    execute_write ( [ this, &reclaimed ] {
+        statement before ( "PRAGMA freelist_count" );
+        long long free_before = before.step() ? before.column_int64 ( 0 ) : 0;
+
+        ostringstream pragma;
+        pragma << "PRAGMA incremental_vacuum(" << vacuum_pages_ << ")";
+        statement vacuum ( pragma.str() );
+        vacuum.exec();
+
+        statement after ( "PRAGMA freelist_count" );
+        long long free_after = after.step() ? after.column_int64 ( 0 ) : 0;
+
+        reclaimed = std::max ( free_before - free_after, 0LL );
+        global::stat_set ( "db.freelist_pages", free_after );
+        return true;
+    } );
+
+    statement page_count ( "PRAGMA page_count" );
+    statement page_size ( "PRAGMA page_size" );
+    if ( page_count.step() && page_size.step() )
+    {
+        global::stat_set ( "db.size_bytes", page_count.column_int64 ( 0 ) * page_size.column_int64 ( 0 ) );
+    }
+
+    if ( reclaimed > 0 )
+    {
+        LOG ( INFO ) << "retention: reclaimed " << reclaimed << " page(s)";
+        global::stat_add ( "db.pages_reclaimed", reclaimed );
+    }
+}
+
+void
+start_retention ( ptree const& config )
+{
+    static retention* job = new retention ( config );
+    job->start();
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef RETENTION_HPP
+#define RETENTION_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+
+namespace app
+{
+
+using boost::posix_time::time_duration;
+using boost::property_tree::ptree;
+using std::string;
+
+// Background job that deletes finished rows from events and uploads once
+// they are older than retention.max_age_days, or once a table holds more
+// than retention.max_rows rows, and hands the freed pages back to the
+// file system with incremental vacuum. Uploaded blobs nothing refers to
+// any more are removed from the blob store along with their rows. Deletes go through the writer in
+// small batches with a pause in between so other writes are not held up.
+class retention : boost::noncopyable
+{
+public:
+    retention ( ptree const & );
+    ~retention() {}
+
+    bool enabled() const { return enabled_; }
+    void start();
+
+private:
+    void run();
+    void purge ( string const& table, string const& finished );
+    long long delete_batch ( string const& sql, string const& age, long long limit );
+    long long count_rows ( string const& table );
+    void purge_blobs();
+    void vacuum();
+
+private:
+    bool enabled_;
+    int max_age_days_;
+    long long max_rows_;
+    long long batch_size_;
+    int vacuum_pages_;
+    time_duration interval_;
+    time_duration batch_pause_;
+    boost::filesystem::path blobs_root_;
+    boost::thread thread_;
+};
+
+void start_retention ( ptree const & );
+
+}
+
+#endif
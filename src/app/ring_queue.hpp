@@ -0,0 +1,269 @@
+#ifndef RING_QUEUE_HPP
+#define RING_QUEUE_HPP
+
+#include "squeue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed capacity queue with the interface of squeue for hot producer to
+// consumer streams. Producers claim slots with a compare-and-swap on a
+// ring of sequence-numbered cells, so any number of producers may push
+// without a lock; there must be a single consumer. Nothing is locked or
+// signalled on the push path unless the consumer is parked: it spins for
+// a while before it sleeps on a condition variable. On a single core
+// spinning only delays the producers, so there it parks right away.
+//
+// The capacity is rounded up to a power of two. Only the block and drop
+// newest overflow policies are supported; drop oldest would need the
+// producers to pop, and is treated as drop newest. A blocked producer
+// yields until a slot frees up.
+template < typename T >
+class ring_queue
+{
+private:
+    static const size_t cache_line = 64;
+    static const int spin_limit = 2000;
+
+    struct cell
+    {
+        std::atomic< size_t > sequence;
+        T value;
+    };
+
+    // Producer and consumer positions live on cache lines of their own so
+    // that the two sides do not invalidate each other's line.
+    char d_pad0[cache_line];
+    std::atomic< size_t > d_tail;
+    char d_pad1[cache_line - sizeof ( std::atomic< size_t > )];
+    size_t d_head;
+    char d_pad2[cache_line - sizeof ( size_t )];
+    std::atomic< bool > d_parked;
+    std::atomic< bool > d_closed;
+    std::atomic< size_t > d_dropped;
+
+    std::vector< cell > d_cells;
+    size_t d_mask;
+    overflow_policy d_policy;
+    int d_spins;
+    std::mutex d_mutex;
+    std::condition_variable d_condition;
+
+public:
+    ring_queue ( size_t capacity, overflow_policy policy = overflow_block )
+        : d_tail ( 0 ), d_head ( 0 ), d_parked ( false ), d_closed ( false ), d_dropped ( 0 ),
+          d_cells ( round_up ( capacity ) ), d_mask ( d_cells.size() - 1 ), d_policy ( policy ),
+          d_spins ( std::thread::hardware_concurrency() > 1 ? spin_limit : 1 )
+    {
+        for ( size_t i = 0; i < d_cells.size(); ++i )
+            d_cells[i].sequence.store ( i, std::memory_order_relaxed );
+    }
+
+    // False if the value was not queued: the queue is closed, or it is
+    // full and drops the newest item.
+    bool push ( T const& value )
+    {
+        size_t pos = d_tail.load ( std::memory_order_relaxed );
+        while ( true )
+        {
+            if ( d_closed.load ( std::memory_order_relaxed ) )
+                return false;
+
+            cell& c = d_cells[pos & d_mask];
+            size_t seq = c.sequence.load ( std::memory_order_acquire );
+            intptr_t diff = intptr_t ( seq ) - intptr_t ( pos );
+
+            if ( diff == 0 )
+            {
+                if ( d_tail.compare_exchange_weak ( pos, pos + 1, std::memory_order_relaxed ) )
+                {
+                    c.value = value;
+                    c.sequence.store ( pos + 1, std::memory_order_release );
+                    break;
+                }
+            }
+            else if ( diff < 0 )
+            {
+                // Full: the consumer has not released this cell yet.
+                if ( d_policy != overflow_block )
+                {
+                    d_dropped.fetch_add ( 1, std::memory_order_relaxed );
+                    return false;
+                }
+                std::this_thread::yield();
+                pos = d_tail.load ( std::memory_order_relaxed );
+            }
+            else
+            {
+                pos = d_tail.load ( std::memory_order_relaxed );
+            }
+        }
+
+        // Pairs with the fence in park(): either the consumer sees the new
+        // item before it sleeps, or this sees that it is parked.
+        std::atomic_thread_fence ( std::memory_order_seq_cst );
+        if ( d_parked.load ( std::memory_order_relaxed ) )
+        {
+            std::lock_guard< std::mutex > lock ( d_mutex );
+            d_condition.notify_one();
+        }
+        return true;
+    }
+
+    // Blocks until a value is available. Returns a default constructed
+    // value once the queue is closed and empty.
+    T pop()
+    {
+        T rc = T();
+        pop ( rc );
+        return rc;
+    }
+
+    // Blocks until a value is available; false once closed and empty.
+    bool pop ( T& value )
+    {
+        while ( true )
+        {
+            if ( spin_pop ( value ) )
+                return true;
+            if ( d_closed.load ( std::memory_order_acquire ) )
+                return try_pop ( value );
+            park ( nullptr );
+        }
+    }
+
+    bool try_pop ( T& value )
+    {
+        cell& c = d_cells[d_head & d_mask];
+        size_t seq = c.sequence.load ( std::memory_order_acquire );
+        if ( seq != d_head + 1 )
+            return false;
+
+        value = std::move ( c.value );
+        c.sequence.store ( d_head + d_mask + 1, std::memory_order_release );
+        ++d_head;
+        return true;
+    }
+
+    template < typename Rep, typename Period >
+    bool pop_for ( T& value, std::chrono::duration< Rep, Period > const& timeout )
+    {
+        return pop ( value, std::chrono::steady_clock::now() + timeout );
+    }
+
+    // Waits for a value until the deadline; false if none arrived.
+    template < typename Clock, typename Duration >
+    bool pop ( T& value, std::chrono::time_point< Clock, Duration > const& deadline )
+    {
+        while ( true )
+        {
+            if ( spin_pop ( value ) )
+                return true;
+            if ( d_closed.load ( std::memory_order_acquire ) || Clock::now() >= deadline )
+                return try_pop ( value );
+            park ( &deadline );
+        }
+    }
+
+    // Waits for at least one value, then moves up to max_items of them to
+    // the end of out. Returns how many were moved; 0 once the queue is
+    // closed and empty.
+    size_t pop_batch ( std::vector<T>& out, size_t max_items )
+    {
+        if ( max_items == 0 )
+            return 0;
+
+        T value;
+        if ( !pop ( value ) )
+            return 0;
+        out.push_back ( std::move ( value ) );
+
+        size_t n = 1;
+        while ( n < max_items && try_pop ( value ) )
+        {
+            out.push_back ( std::move ( value ) );
+            ++n;
+        }
+        return n;
+    }
+
+    // Refuses further pushes and wakes the consumer.
+    void close()
+    {
+        d_closed.store ( true, std::memory_order_release );
+        std::lock_guard< std::mutex > lock ( d_mutex );
+        d_condition.notify_all();
+    }
+
+    bool closed() const
+    {
+        return d_closed.load ( std::memory_order_acquire );
+    }
+
+    // Approximate while producers are pushing.
+    size_t size() const
+    {
+        size_t tail = d_tail.load ( std::memory_order_acquire );
+        size_t head = d_head;
+        return tail > head ? tail - head : 0;
+    }
+
+    // Items refused because the queue was full.
+    size_t dropped() const
+    {
+        return d_dropped.load ( std::memory_order_relaxed );
+    }
+
+private:
+    static size_t round_up ( size_t capacity )
+    {
+        size_t size = 2;
+        while ( size < capacity )
+            size <<= 1;
+        return size;
+    }
+
+    bool spin_pop ( T& value )
+    {
+        for ( int i = 0; i < d_spins; ++i )
+        {
+            if ( try_pop ( value ) )
+                return true;
+        }
+        return false;
+    }
+
+    bool ready() const
+    {
+        return d_cells[d_head & d_mask].sequence.load ( std::memory_order_acquire ) == d_head + 1;
+    }
+
+    template < typename TimePoint >
+    void park ( TimePoint const* deadline )
+    {
+        std::unique_lock< std::mutex > lock ( d_mutex );
+        d_parked.store ( true, std::memory_order_relaxed );
+        std::atomic_thread_fence ( std::memory_order_seq_cst );
+
+        auto wake = [this] { return ready() || d_closed.load ( std::memory_order_acquire ); };
+        if ( deadline )
+            d_condition.wait_until ( lock, *deadline, wake );
+        else
+            d_condition.wait ( lock, wake );
+
+        d_parked.store ( false, std::memory_order_relaxed );
+    }
+
+    void park ( std::nullptr_t )
+    {
+        park ( static_cast< std::chrono::steady_clock::time_point const* > ( nullptr ) );
+    }
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "schema.hpp"
+
+#include <glog/logging.h>
+
+#include <sstream>
+#include <string>
+
+namespace app
+{
+
+using std::ostringstream;
+using std::string;
+
+namespace
+{
+
+// Upgrade steps, indexed by the version they produce. Steps are only ever
+// appended.
+char const* const steps[] =
+{
+    // 0: tables as created by init_database.
+    "",
+
+    // 1: the uploader and report poll for unsent uploads and unprocessed
+    // events every few seconds. This sqlite predates partial indexes, so
+    // lead with the flag and end with id: the scan stays inside the pending
+    // rows and comes out in id order without a sort.
+    "CREATE INDEX IF NOT EXISTS uploads_pending ON uploads (uploaded, type, id);"
+    "CREATE INDEX IF NOT EXISTS events_pending ON events (processed, reporter, id);",
+
+    // 2: retry, chunk and digest bookkeeping of uploads (see columns
+    // below) and the registry of stored blobs. Retention looks up whether
+    // any upload still refers to a blob.
+    "CREATE TABLE IF NOT EXISTS blobs"
+    " (digest TEXT PRIMARY KEY, size INTEGER NOT NULL, uploaded INTEGER NOT NULL DEFAULT 0);"
+    "CREATE INDEX IF NOT EXISTS uploads_digest ON uploads (digest);",
+
+    // 3: files that went out inside an event bundle have no upload row of
+    // their own; their blobs are marked uploaded with the bundle's.
+    "CREATE TABLE IF NOT EXISTS bundle_members"
+    " (bundle TEXT NOT NULL, member TEXT NOT NULL, PRIMARY KEY (bundle, member));",
+};
+
+static_assert ( sizeof ( steps ) / sizeof ( steps[0] ) == schema_version + 1,
+                "one upgrade step per schema version" );
+
+// Columns added by a step, before its statements run. Databases from
+// before the schema was versioned may already have some of them, and
+// sqlite cannot add a column only if it is missing, so each one is
+// checked first.
+struct column
+{
+    int version;
+    char const* table;
+    char const* name;
+    char const* definition;
+};
+
+column const columns[] =
+{
+    { 2, "uploads", "attempts", "INTEGER NOT NULL DEFAULT 0" },
+    { 2, "uploads", "next_attempt", "DATETIME" },
+    { 2, "uploads", "sent_bytes", "INTEGER NOT NULL DEFAULT 0" },
+    { 2, "uploads", "digest", "TEXT" },
+};
+
+bool column_exists ( sqlite3* sql, char const* table, char const* name )
+{
+    sqlite3_stmt* stmt;
+    bool found = false;
+
+    string query = string ( "PRAGMA table_info(" ) + table + ")";
+    if ( sqlite3_prepare_v2 ( sql, query.c_str(), -1, &stmt, NULL ) != SQLITE_OK )
+        return false;
+
+    while ( !found && sqlite3_step ( stmt ) == SQLITE_ROW )
+    {
+        found = string ( reinterpret_cast< const char * > (
+            sqlite3_column_text ( stmt, 1 ) ) ).compare ( name ) == 0;
+    }
+
+    sqlite3_finalize ( stmt );
+    return found;
+}
+
+int pragma_value ( sqlite3* sql, char const* pragma )
+{
+    sqlite3_stmt* stmt;
+    int value = 0;
+
+    if ( sqlite3_prepare_v2 ( sql, pragma, -1, &stmt, NULL ) != SQLITE_OK )
+        return 0;
+    if ( sqlite3_step ( stmt ) == SQLITE_ROW )
+        value = sqlite3_column_int ( stmt, 0 );
+    sqlite3_finalize ( stmt );
+
+    return value;
+}
+
+}
+
+int
+upgrade_schema ( sqlite3* sql )
+{
+    int version = pragma_value ( sql, "PRAGMA user_version" );
+
+    while ( version < schema_version )
+    {
+        int next = version + 1;
+        ostringstream stmt;
+        stmt << "BEGIN;";
+        for ( auto const& c : columns )
+        {
+            if ( c.version == next && !column_exists ( sql, c.table, c.name ) )
+                stmt << "ALTER TABLE " << c.table << " ADD COLUMN "
+                     << c.name << " " << c.definition << ";";
+        }
+        stmt << steps[next]
+             << "PRAGMA user_version=" << next << ";"
+             << "COMMIT;";
+
+        char* message = NULL;
+        if ( sqlite3_exec ( sql, stmt.str().c_str(), 0, 0, &message ) != SQLITE_OK )
+        {
+            LOG ( ERROR ) << "Schema upgrade to version " << next << " failed: "
+                          << ( message ? message : "" );
+            sqlite3_free ( message );
+            sqlite3_exec ( sql, "ROLLBACK", 0, 0, 0 );
+            break;
+        }
+
+        LOG ( INFO ) << "Database schema upgraded to version " << next;
+        version = next;
+    }
+
+    return version;
+}
+
+void
+enable_incremental_vacuum ( sqlite3* sql )
+{
+    const int incremental = 2;
+    if ( pragma_value ( sql, "PRAGMA auto_vacuum" ) == incremental )
+        return;
+
+    LOG ( INFO ) << "Enabling incremental vacuum, rebuilding database...";
+    if ( sqlite3_exec ( sql, "PRAGMA auto_vacuum=INCREMENTAL; VACUUM", 0, 0, 0 ) != SQLITE_OK )
+    {
+        LOG ( ERROR ) << "Could not enable incremental vacuum: " << sqlite3_errmsg ( sql );
+    }
+}
+
+}
@@ -0,0 +1,25 @@
+#ifndef SCHEMA_HPP
+#define SCHEMA_HPP
+
+#include <sqlite3.h>
+
+namespace app
+{
+
+// Version the schema upgrades below bring a database to. It is kept in
+// PRAGMA user_version.
+const int schema_version = 3;
+
+// Applies every upgrade step newer than the database's user_version, each
+// in its own transaction, and returns the version reached. Steps run on
+// top of the tables init_database creates.
+int upgrade_schema ( sqlite3* );
+
+// Switches the database to incremental auto-vacuum so that pages freed by
+// deletes can be returned to the file system a few at a time. Databases
+// created without it need one full VACUUM, which this runs.
+void enable_incremental_vacuum ( sqlite3* );
+
+}
+
+#endif
@@ -0,0 +1,388 @@
+#include "segment_store.hpp"
+#include "common.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/foreach.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+namespace app
+{
+
+using namespace boost::posix_time;
+
+namespace
+{
+
+const unsigned int frame_magic = 0x50414e53;  // "SNAP"
+const unsigned int index_magic = 0x58444953;  // "SIDX"
+
+struct frame_header
+{
+    unsigned int magic;
+    unsigned int size;
+    long long time;
+};
+
+struct index_trailer
+{
+    unsigned int count;
+    unsigned int magic;
+};
+
+ptime const epoch ( boost::gregorian::date ( 1970, 1, 1 ) );
+
+long long to_micros ( ptime const& t )
+{
+    return ( t - epoch ).total_microseconds();
+}
+
+ptime from_micros ( long long us )
+{
+    return epoch + microseconds ( us );
+}
+
+ptime hour_of ( ptime const& t )
+{
+    return ptime ( t.date(), hours ( t.time_of_day().hours() ) );
+}
+
+string segment_name ( ptime const& hour )
+{
+    char name[32];
+    auto d = hour.date();
+    std::snprintf ( name, sizeof ( name ), "%04d-%02d-%02d %02d.seg",
+                    int ( d.year() ), int ( d.month() ), int ( d.day() ),
+                    int ( hour.time_of_day().hours() ) );
+    return name;
+}
+
+long long file_size_of ( std::FILE* f )
+{
+    struct stat st;
+    return fstat ( fileno ( f ), &st ) == 0 ? st.st_size : 0;
+}
+
+}
+
+// A read-only mapping of the written part of a segment.
+class segment_store::mapping : boost::noncopyable
+{
+public:
+    mapping ( path const& file, size_t length ) : addr_ ( MAP_FAILED ), length_ ( length )
+    {
+        int fd = ::open ( file.string().c_str(), O_RDONLY );
+        if ( fd < 0 )
+            return;
+        addr_ = mmap ( NULL, length_, PROT_READ, MAP_SHARED, fd, 0 );
+        ::close ( fd );
+    }
+
+    ~mapping()
+    {
+        if ( addr_ != MAP_FAILED )
+            munmap ( addr_, length_ );
+    }
+
+    char const* data() const
+    {
+        return addr_ == MAP_FAILED ? NULL : static_cast< char const* > ( addr_ );
+    }
+
+private:
+    void* addr_;
+    size_t length_;
+};
+
+segment_store::~segment_store()
+{
+    close();
+}
+
+void
+segment_store::open()
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    boost::system::error_code ec;
+
+    create_directories ( dir_, ec );
+    for ( directory_iterator it ( dir_, ec ), end; !ec && it != end; it.increment ( ec ) )
+    {
+        int year, month, day, hour;
+        auto name = it->path().filename().string();
+        if ( it->path().extension() != ".seg"
+             || std::sscanf ( name.c_str(), "%4d-%2d-%2d %2d", &year, &month, &day, &hour ) != 4 )
+            continue;
+
+        ptime key;
+        try
+        {
+            key = ptime ( boost::gregorian::date ( year, month, day ), hours ( hour ) );
+        }
+        catch ( std::exception const& )
+        {
+            continue;
+        }
+
+        segment s;
+        s.file = it->path();
+        if ( load ( s ) )
+            segments_[key] = s;
+    }
+
+    LOG ( INFO ) << "segment store: " << segments_.size() << " segment(s) in " << dir_;
+}
+
+bool
+segment_store::load ( segment& s )
+{
+    std::FILE* f = std::fopen ( s.file.string().c_str(), "rb" );
+    if ( !f )
+        return false;
+
+    long long size = file_size_of ( f );
+    s.index.clear();
+    s.data_end = 0;
+
+    // A closed segment ends with its index.
+    index_trailer trailer;
+    if ( size >= static_cast< long long > ( sizeof ( trailer ) )
+         && std::fseek ( f, size - sizeof ( trailer ), SEEK_SET ) == 0
+         && std::fread ( &trailer, sizeof ( trailer ), 1, f ) == 1
+         && trailer.magic == index_magic )
+    {
+        long long index_size = trailer.count * sizeof ( entry );
+        long long start = size - sizeof ( trailer ) - index_size;
+        if ( start >= 0 && std::fseek ( f, start, SEEK_SET ) == 0 )
+        {
+            s.index.resize ( trailer.count );
+            if ( trailer.count == 0
+                 || std::fread ( &s.index[0], sizeof ( entry ), trailer.count, f ) == trailer.count )
+            {
+                s.data_end = start;
+                std::fclose ( f );
+                return true;
+            }
+        }
+    }
+
+    // Otherwise the writer stopped without closing it; keep every frame
+    // up to the first torn one.
+    s.index.clear();
+    std::fseek ( f, 0, SEEK_SET );
+    frame_header header;
+    long long offset = 0;
+    while ( std::fread ( &header, sizeof ( header ), 1, f ) == 1
+            && header.magic == frame_magic
+            && offset + static_cast< long long > ( sizeof ( header ) ) + header.size <= size )
+    {
+        entry e = { header.time, offset + static_cast< long long > ( sizeof ( header ) ), header.size, 0 };
+        s.index.push_back ( e );
+        offset = e.offset + header.size;
+        if ( std::fseek ( f, offset, SEEK_SET ) != 0 )
+            break;
+    }
+    s.data_end = offset;
+    std::fclose ( f );
+
+    std::stable_sort ( s.index.begin(), s.index.end(),
+        [] ( entry const& a, entry const& b ) { return a.time < b.time; } );
+
+    LOG ( INFO ) << "segment store: recovered " << s.index.size() << " frame(s) from " << s.file;
+    return true;
+}
+
+segment_store::segment*
+segment_store::segment_for ( ptime const& time )
+{
+    auto key = hour_of ( time );
+    if ( current_ && segments_.count ( key ) && &segments_[key] == current_ )
+        return current_;
+
+    seal();
+
+    auto it = segments_.find ( key );
+    if ( it == segments_.end() )
+    {
+        segment s;
+        s.file = dir_ / segment_name ( key );
+        s.data_end = 0;
+        it = segments_.insert ( std::make_pair ( key, s ) ).first;
+    }
+
+    // Reopening a segment drops its footer, or a torn frame at its end;
+    // the footer is written again when it is closed.
+    auto& s = it->second;
+    std::FILE* f = std::fopen ( s.file.string().c_str(), "r+b" );
+    if ( !f )
+        f = std::fopen ( s.file.string().c_str(), "w+b" );
+    if ( !f || ftruncate ( fileno ( f ), s.data_end ) != 0
+         || std::fseek ( f, s.data_end, SEEK_SET ) != 0 )
+    {
+        LOG ( ERROR ) << "segment store: cannot open " << s.file;
+        if ( f )
+            std::fclose ( f );
+        return NULL;
+    }
+
+    current_ = &s;
+    file_ = f;
+    return current_;
+}
+
+bool
+segment_store::append ( ptime const& time, char const* data, size_t size )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    auto s = segment_for ( time );
+    if ( !s )
+        return false;
+
+    frame_header header = { frame_magic, static_cast< unsigned int > ( size ), to_micros ( time ) };
+    if ( std::fwrite ( &header, sizeof ( header ), 1, file_ ) != 1
+         || std::fwrite ( data, 1, size, file_ ) != size
+         || std::fflush ( file_ ) != 0 )
+    {
+        LOG ( ERROR ) << "segment store: write to " << s->file << " failed";
+        std::clearerr ( file_ );
+        if ( ftruncate ( fileno ( file_ ), s->data_end ) != 0 )
+            LOG ( ERROR ) << "segment store: cannot truncate " << s->file;
+        std::fseek ( file_, s->data_end, SEEK_SET );
+        return false;
+    }
+
+    entry e = { header.time, s->data_end + static_cast< long long > ( sizeof ( header ) ),
+                header.size, 0 };
+    s->data_end = e.offset + size;
+
+    // Frames come in order but for clock steps.
+    auto pos = std::upper_bound ( s->index.begin(), s->index.end(), e,
+        [] ( entry const& a, entry const& b ) { return a.time < b.time; } );
+    s->index.insert ( pos, e );
+    return true;
+}
+
+void
+segment_store::seal()
+{
+    if ( !current_ )
+        return;
+
+    index_trailer trailer = { static_cast< unsigned int > ( current_->index.size() ), index_magic };
+    if ( ( current_->index.empty()
+           || std::fwrite ( &current_->index[0], sizeof ( entry ), current_->index.size(), file_ )
+              == current_->index.size() )
+         && std::fwrite ( &trailer, sizeof ( trailer ), 1, file_ ) == 1 )
+    {
+        std::fflush ( file_ );
+    }
+    else
+    {
+        // Without a footer the next load walks the frame headers instead.
+        LOG ( ERROR ) << "segment store: cannot write the index of " << current_->file;
+    }
+
+    std::fclose ( file_ );
+    file_ = NULL;
+    current_ = NULL;
+}
+
+void
+segment_store::close()
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    seal();
+}
+
+segment_store::frames
+segment_store::between ( ptime const& from, ptime const& to )
+{
+    frames result;
+    auto first = to_micros ( from );
+    auto last = to_micros ( to );
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    for ( auto it = segments_.lower_bound ( hour_of ( from ) );
+          it != segments_.end() && it->first < to; ++it )
+    {
+        auto const& s = it->second;
+        entry lo = { first, 0, 0, 0 };
+        entry hi = { last, 0, 0, 0 };
+        auto by_time = [] ( entry const& a, entry const& b ) { return a.time < b.time; };
+        auto begin = std::lower_bound ( s.index.begin(), s.index.end(), lo, by_time );
+        auto end = std::lower_bound ( begin, s.index.end(), hi, by_time );
+        if ( begin == end )
+            continue;
+
+        auto m = boost::shared_ptr< mapping > ( new mapping ( s.file, s.data_end ) );
+        if ( !m->data() )
+        {
+            LOG ( ERROR ) << "segment store: cannot map " << s.file;
+            continue;
+        }
+
+        for ( ; begin != end; ++begin )
+        {
+            frame f = { from_micros ( begin->time ), m->data() + begin->offset, begin->size };
+            result.items.push_back ( f );
+        }
+        result.mappings.push_back ( m );
+    }
+
+    return result;
+}
+
+vector< path >
+segment_store::export_between ( ptime const& from, ptime const& to, path const& dir )
+{
+    vector< path > files;
+    auto range = between ( from, to );
+
+    boost::system::error_code ec;
+    create_directories ( dir, ec );
+
+    BOOST_FOREACH ( auto const& f, range.items )
+    {
+        auto file = dir / ( common::get_simple_utc_string ( f.time ) + ".jpg" );
+        std::ofstream out ( file.string().c_str(), std::ofstream::binary | std::ofstream::trunc );
+        out.write ( f.data, f.size );
+        if ( out )
+            files.push_back ( file );
+        else
+            LOG ( ERROR ) << "segment store: cannot export " << file;
+    }
+
+    return files;
+}
+
+void
+segment_store::expire_before ( ptime const& cutoff )
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    for ( auto it = segments_.begin();
+          it != segments_.end() && it->first + hours ( 1 ) <= cutoff; )
+    {
+        if ( &it->second == current_ )
+        {
+            ++it;
+            continue;
+        }
+
+        boost::system::error_code ec;
+        remove ( it->second.file, ec );
+        LOG ( INFO ) << "segment store: expired " << it->second.file;
+        segments_.erase ( it++ );
+    }
+}
+
+}
@@ -0,0 +1,105 @@
+#ifndef SEGMENT_STORE_HPP
+#define SEGMENT_STORE_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using namespace boost::filesystem;
+using boost::posix_time::ptime;
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+
+// Snapshot storage that appends frames to one segment file per hour,
+// "YYYY-MM-DD HH.seg", instead of writing a file per frame. Each frame is
+// stored behind a small header; when a segment is closed an index of
+// (time, offset, size) entries is appended as its footer, and a segment
+// left without one after a crash is recovered by walking its headers.
+//
+// Reads map the segments and hand out pointers into the mapping, so
+// frames are only copied when an event is exported. Expiry removes whole
+// segments.
+class segment_store : boost::noncopyable
+{
+public:
+    // A frame inside a mapped segment. The data stays valid as long as
+    // the frames object it came from.
+    struct frame
+    {
+        ptime time;
+        char const* data;
+        size_t size;
+    };
+
+    class mapping;
+    struct frames
+    {
+        vector< frame > items;
+        vector< shared_ptr< mapping > > mappings;
+    };
+
+    segment_store ( path const& dir ) : dir_ ( dir ), current_ ( NULL ), file_ ( NULL ) {}
+    ~segment_store();
+
+    // Loads the indexes of the segments already in the directory.
+    void open();
+
+    // Closes the segment being written and writes its footer.
+    void close();
+
+    bool append ( ptime const &, char const*, size_t );
+
+    // Frames taken at or after from and before to, oldest first.
+    frames between ( ptime const &, ptime const & );
+
+    // Writes the frames in the range to dir as "YYYY-MM-DD HH-MM-SS.jpg"
+    // files and returns their paths.
+    vector< path > export_between ( ptime const &, ptime const &, path const & );
+
+    // Removes the segments whose hour ended before the given time.
+    void expire_before ( ptime const & );
+
+private:
+    struct entry
+    {
+        long long time;
+        long long offset;
+        unsigned int size;
+        unsigned int reserved;
+    };
+
+    struct segment
+    {
+        path file;
+        vector< entry > index;
+        long long data_end;
+    };
+
+    typedef std::map< ptime, segment > segment_map;
+
+    segment* segment_for ( ptime const & );
+    bool load ( segment & );
+    void seal();
+
+private:
+    path dir_;
+    boost::mutex mutex_;
+    segment_map segments_;
+    segment* current_;
+    std::FILE* file_;
+};
+
+}
+
+#endif
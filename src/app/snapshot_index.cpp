@@ -0,0 +1,128 @@
+#include "snapshot_index.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdio>
+
+namespace app
+{
+
+using namespace boost::posix_time;
+
+namespace
+{
+
+struct entry_time
+{
+    template < typename Entry >
+    bool operator() ( Entry const& e, ptime const& t ) const { return e.time < t; }
+    template < typename Entry >
+    bool operator() ( ptime const& t, Entry const& e ) const { return t < e.time; }
+};
+
+}
+
+ptime
+snapshot_index::parse_name ( string const& name )
+{
+    // Scanned by hand; an input facet per file is what made directory
+    // scans slow.
+    int year, month, day, hours, minutes, secs;
+    if ( std::sscanf ( name.c_str(), "%4d-%2d-%2d %2d-%2d-%2d",
+                       &year, &month, &day, &hours, &minutes, &secs ) != 6 )
+        return ptime ( not_a_date_time );
+
+    try
+    {
+        return ptime ( boost::gregorian::date ( year, month, day ),
+                       time_duration ( hours, minutes, secs ) );
+    }
+    catch ( std::exception const& )
+    {
+        return ptime ( not_a_date_time );
+    }
+}
+
+void
+snapshot_index::rebuild()
+{
+    std::deque< entry > entries;
+    boost::system::error_code ec;
+
+    if ( is_directory ( dir_, ec ) )
+    {
+        for ( directory_iterator it ( dir_, ec ), end; !ec && it != end; it.increment ( ec ) )
+        {
+            if ( !is_regular_file ( it->status() ) )
+                continue;
+
+            entry e;
+            e.name = it->path().filename().string();
+            e.time = parse_name ( e.name );
+            if ( !e.time.is_not_a_date_time() )
+                entries.push_back ( e );
+        }
+    }
+
+    std::sort ( entries.begin(), entries.end(),
+        [] ( entry const& a, entry const& b ) { return a.time < b.time; } );
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+    entries_.swap ( entries );
+    trim();
+
+    LOG ( INFO ) << "snapshot index: " << entries_.size() << " snapshot(s) in " << dir_;
+}
+
+void
+snapshot_index::add ( path const& file )
+{
+    entry e;
+    e.name = file.filename().string();
+    e.time = parse_name ( e.name );
+    if ( e.time.is_not_a_date_time() )
+        return;
+    auto const& time = e.time;
+
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    // Snapshots arrive in order, so this is an append but for clock steps.
+    if ( entries_.empty() || !( time < entries_.back().time ) )
+        entries_.push_back ( e );
+    else
+        entries_.insert ( std::upper_bound ( entries_.begin(), entries_.end(), time, entry_time() ), e );
+    trim();
+}
+
+vector< path >
+snapshot_index::between ( ptime const& from, ptime const& to ) const
+{
+    vector< path > results;
+    boost::mutex::scoped_lock lock ( mutex_ );
+
+    auto first = std::lower_bound ( entries_.begin(), entries_.end(), from, entry_time() );
+    auto last = std::lower_bound ( first, entries_.end(), to, entry_time() );
+    for ( ; first != last; ++first )
+    {
+        results.push_back ( dir_ / first->name );
+    }
+
+    return results;
+}
+
+size_t
+snapshot_index::size() const
+{
+    boost::mutex::scoped_lock lock ( mutex_ );
+    return entries_.size();
+}
+
+void
+snapshot_index::trim()
+{
+    while ( capacity_ > 0 && entries_.size() > capacity_ )
+        entries_.pop_front();
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef SNAPSHOT_INDEX_HPP
+#define SNAPSHOT_INDEX_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using namespace boost::filesystem;
+using boost::posix_time::ptime;
+using std::string;
+using std::vector;
+
+// In-memory index of the snapshots in one camera directory, sorted by the
+// time in their "YYYY-MM-DD HH-MM-SS.jpg" names. It is built from one
+// directory scan and then kept up to date as snapshots are written, so a
+// range query is a binary search instead of a walk over every file. Only
+// the newest `capacity` snapshots are kept; older ones stay on disk but
+// drop out of the index.
+class snapshot_index : boost::noncopyable
+{
+public:
+    snapshot_index ( path const& dir, size_t capacity )
+        : dir_ ( dir ), capacity_ ( capacity ) {}
+    ~snapshot_index() {}
+
+    // Replaces the index with the snapshots found in the directory.
+    void rebuild();
+
+    // Indexes a newly written snapshot under the time in its name.
+    void add ( path const & );
+
+    // Snapshots taken at or after from and before to, oldest first.
+    vector< path > between ( ptime const &, ptime const & ) const;
+
+    size_t size() const;
+
+    // Time encoded in a snapshot file name; not_a_date_time if it has none.
+    static ptime parse_name ( string const & );
+
+private:
+    struct entry
+    {
+        ptime time;
+        string name;
+    };
+
+    void trim();
+
+private:
+    path dir_;
+    size_t capacity_;
+    mutable boost::mutex mutex_;
+    std::deque< entry > entries_;
+};
+
+}
+
+#endif
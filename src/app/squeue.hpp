@@ -4,38 +4,187 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/shared_ptr.hpp>
 
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <deque>
+#include <vector>
 
 using boost::property_tree::ptree;
 using boost::shared_ptr;
 
+// What push does when a bounded queue is full.
+enum overflow_policy
+{
+    overflow_block,         // wait for the consumer to make room
+    overflow_drop_oldest,   // discard the item at the head of the queue
+    overflow_drop_newest    // discard the item being pushed
+};
+
+// Blocking FIFO queue shared between threads. A capacity of 0 leaves it
+// unbounded. Once closed, pushes are refused and waiting consumers return
+// after draining what is left, so their threads can be joined.
 template < typename T >
 class squeue
 {
 private:
     std::mutex d_mutex;
     std::condition_variable d_condition;
+    std::condition_variable d_not_full;
     std::deque<T> d_queue;
+    size_t d_capacity;
+    overflow_policy d_policy;
+    size_t d_dropped;
+    bool d_closed;
 
 public:
-    void push ( T const& value )
+    squeue ( size_t capacity = 0, overflow_policy policy = overflow_block )
+        : d_capacity ( capacity ), d_policy ( policy ), d_dropped ( 0 ), d_closed ( false )
+    {}
+
+    // Changes the bound; for queues that are set up after construction.
+    void limit ( size_t capacity, overflow_policy policy )
+    {
+        {
+            std::unique_lock< std::mutex > lock ( this->d_mutex );
+            d_capacity = capacity;
+            d_policy = policy;
+        }
+        this->d_not_full.notify_all();
+    }
+
+    // False if the value was not queued: the queue is closed, or it is
+    // full and drops the newest item.
+    bool push ( T const& value )
     {
         {
             std::unique_lock< std::mutex > lock ( this->d_mutex );
+            if ( d_capacity > 0 && d_queue.size() >= d_capacity && !d_closed )
+            {
+                switch ( d_policy )
+                {
+                case overflow_block:
+                    this->d_not_full.wait ( lock, [=] {
+                        return this->d_closed || this->d_capacity == 0
+                            || this->d_queue.size() < this->d_capacity; } );
+                    break;
+                case overflow_drop_oldest:
+                    d_queue.pop_back();
+                    ++d_dropped;
+                    break;
+                case overflow_drop_newest:
+                    ++d_dropped;
+                    return false;
+                }
+            }
+            if ( d_closed )
+                return false;
             d_queue.push_front ( value );
         }
         this->d_condition.notify_one();
+        return true;
     }
 
+    // Blocks until a value is available. Returns a default constructed
+    // value once the queue is closed and empty.
     T pop()
+    {
+        T rc = T();
+        pop ( rc );
+        return rc;
+    }
+
+    // Blocks until a value is available; false once closed and empty.
+    bool pop ( T& value )
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        this->d_condition.wait ( lock, [=] { return this->d_closed || !this->d_queue.empty(); } );
+        return take ( value, lock );
+    }
+
+    bool try_pop ( T& value )
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        return take ( value, lock );
+    }
+
+    template < typename Rep, typename Period >
+    bool pop_for ( T& value, std::chrono::duration< Rep, Period > const& timeout )
+    {
+        return pop ( value, std::chrono::steady_clock::now() + timeout );
+    }
+
+    // Waits for a value until the deadline; false if none arrived.
+    template < typename Clock, typename Duration >
+    bool pop ( T& value, std::chrono::time_point< Clock, Duration > const& deadline )
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        this->d_condition.wait_until ( lock, deadline, [=] { return this->d_closed || !this->d_queue.empty(); } );
+        return take ( value, lock );
+    }
+
+    // Waits for at least one value, then moves up to max_items of them to
+    // the end of out under the same lock. Returns how many were moved; 0
+    // once the queue is closed and empty.
+    size_t pop_batch ( std::vector<T>& out, size_t max_items )
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        this->d_condition.wait ( lock, [=] { return this->d_closed || !this->d_queue.empty(); } );
+
+        size_t n = 0;
+        while ( n < max_items && !d_queue.empty() )
+        {
+            out.push_back ( std::move ( this->d_queue.back() ) );
+            this->d_queue.pop_back();
+            ++n;
+        }
+        lock.unlock();
+
+        if ( n > 0 )
+            this->d_not_full.notify_all();
+        return n;
+    }
+
+    // Refuses further pushes and wakes every waiting producer and consumer.
+    void close()
+    {
+        {
+            std::unique_lock< std::mutex > lock ( this->d_mutex );
+            d_closed = true;
+        }
+        this->d_condition.notify_all();
+        this->d_not_full.notify_all();
+    }
+
+    bool closed()
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        return d_closed;
+    }
+
+    size_t size()
+    {
+        std::unique_lock< std::mutex > lock ( this->d_mutex );
+        return d_queue.size();
+    }
+
+    // Items discarded by the drop policies so far.
+    size_t dropped()
     {
         std::unique_lock< std::mutex > lock ( this->d_mutex );
-        this->d_condition.wait ( lock, [=] { return !this->d_queue.empty(); });
-        T rc ( std::move ( this->d_queue.back() ) );
+        return d_dropped;
+    }
+
+private:
+    bool take ( T& value, std::unique_lock< std::mutex >& lock )
+    {
+        if ( this->d_queue.empty() )
+            return false;
+        value = std::move ( this->d_queue.back() );
         this->d_queue.pop_back();
-        return rc;
+        lock.unlock();
+        this->d_not_full.notify_one();
+        return true;
     }
 
 };
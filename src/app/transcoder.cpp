@@ -0,0 +1,296 @@
+#include "transcoder.hpp"
+#include "global.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <future>
+#include <sstream>
+
+#include <jpeglib.h>
+
+namespace app
+{
+
+using boost::make_shared;
+using std::ostringstream;
+
+namespace
+{
+
+struct jpeg_error_handler
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void on_jpeg_error ( j_common_ptr cinfo )
+{
+    auto handler = reinterpret_cast< jpeg_error_handler* > ( cinfo->err );
+    longjmp ( handler->jump, 1 );
+}
+
+// Shrinks an interleaved image by averaging every source pixel that falls
+// into each destination pixel.
+void area_resample ( vector< JSAMPLE > const& src, size_t sw, size_t sh,
+                     vector< JSAMPLE >& dst, size_t dw, size_t dh, size_t channels )
+{
+    dst.resize ( dw * dh * channels );
+
+    for ( size_t y = 0; y < dh; ++y )
+    {
+        size_t y0 = y * sh / dh;
+        size_t y1 = std::max ( ( y + 1 ) * sh / dh, y0 + 1 );
+
+        for ( size_t x = 0; x < dw; ++x )
+        {
+            size_t x0 = x * sw / dw;
+            size_t x1 = std::max ( ( x + 1 ) * sw / dw, x0 + 1 );
+            size_t count = ( y1 - y0 ) * ( x1 - x0 );
+
+            for ( size_t c = 0; c < channels; ++c )
+            {
+                size_t sum = 0;
+                for ( size_t sy = y0; sy < y1; ++sy )
+                    for ( size_t sx = x0; sx < x1; ++sx )
+                        sum += src[( sy * sw + sx ) * channels + c];
+                dst[( y * dw + x ) * channels + c] = static_cast< JSAMPLE > ( sum / count );
+            }
+        }
+    }
+}
+
+bool recompress ( string const& src, string const& dst, int quality, int max_dimension )
+{
+    jpeg_decompress_struct in;
+    jpeg_compress_struct out;
+    jpeg_error_handler error;
+    vector< JSAMPLE > pixels;
+    vector< JSAMPLE > resized;
+    volatile bool in_created = false;
+    volatile bool out_created = false;
+    FILE* volatile outfile = NULL;
+
+    FILE* infile = std::fopen ( src.c_str(), "rb" );
+    if ( !infile )
+        return false;
+
+    in.err = jpeg_std_error ( &error.pub );
+    out.err = in.err;
+    error.pub.error_exit = on_jpeg_error;
+
+    if ( setjmp ( error.jump ) )
+    {
+        if ( in_created )
+            jpeg_destroy_decompress ( &in );
+        if ( out_created )
+            jpeg_destroy_compress ( &out );
+        std::fclose ( infile );
+        if ( outfile )
+            std::fclose ( outfile );
+        return false;
+    }
+
+    jpeg_create_decompress ( &in );
+    in_created = true;
+    jpeg_stdio_src ( &in, infile );
+    jpeg_read_header ( &in, TRUE );
+
+    // Let the decoder do most of the reduction in the DCT domain, which is
+    // almost free, and keep the output at or above max_dimension.
+    size_t longest = std::max ( in.image_width, in.image_height );
+    in.scale_num = 1;
+    in.scale_denom = 1;
+    while ( max_dimension > 0 && in.scale_denom < 8
+            && longest / ( in.scale_denom * 2 ) >= size_t ( max_dimension ) )
+        in.scale_denom *= 2;
+
+    jpeg_start_decompress ( &in );
+
+    size_t width = in.output_width;
+    size_t height = in.output_height;
+    size_t channels = in.output_components;
+    J_COLOR_SPACE color_space = in.out_color_space;
+
+    pixels.resize ( width * height * channels );
+    while ( in.output_scanline < height )
+    {
+        JSAMPROW row = &pixels[in.output_scanline * width * channels];
+        jpeg_read_scanlines ( &in, &row, 1 );
+    }
+    jpeg_finish_decompress ( &in );
+    jpeg_destroy_decompress ( &in );
+    in_created = false;
+
+    // Finish the remaining reduction with an area average.
+    longest = std::max ( width, height );
+    if ( max_dimension > 0 && longest > size_t ( max_dimension ) )
+    {
+        size_t w = std::max< size_t > ( 1, width * max_dimension / longest );
+        size_t h = std::max< size_t > ( 1, height * max_dimension / longest );
+        area_resample ( pixels, width, height, resized, w, h, channels );
+        pixels.swap ( resized );
+        width = w;
+        height = h;
+    }
+
+    outfile = std::fopen ( dst.c_str(), "wb" );
+    if ( !outfile )
+    {
+        std::fclose ( infile );
+        return false;
+    }
+
+    jpeg_create_compress ( &out );
+    out_created = true;
+    jpeg_stdio_dest ( &out, outfile );
+    out.image_width = width;
+    out.image_height = height;
+    out.input_components = channels;
+    out.in_color_space = color_space;
+    jpeg_set_defaults ( &out );
+    jpeg_set_quality ( &out, quality, TRUE );
+    out.optimize_coding = TRUE;
+
+    jpeg_start_compress ( &out, TRUE );
+    while ( out.next_scanline < height )
+    {
+        JSAMPROW row = &pixels[out.next_scanline * width * channels];
+        jpeg_write_scanlines ( &out, &row, 1 );
+    }
+    jpeg_finish_compress ( &out );
+    jpeg_destroy_compress ( &out );
+
+    std::fclose ( infile );
+    std::fclose ( outfile );
+    return true;
+}
+
+}
+
+jpeg_transcoder::jpeg_transcoder ( ptree const& config )
+{
+    enabled_ = config.get ( "transcode.enabled", false );
+    quality_ = std::min ( std::max ( config.get ( "transcode.quality", 70 ), 1 ), 100 );
+    max_dimension_ = config.get ( "transcode.max_dimension", 640 );
+
+    if ( !enabled_ )
+        return;
+
+    size_t threads = config.get ( "transcode.threads", 2 );
+    work_.reset ( new asio::io_service::work ( io_service_ ) );
+    for ( size_t i = 0; i < std::max< size_t > ( threads, 1 ); ++i )
+    {
+        workers_.create_thread ( boost::bind ( &asio::io_service::run, &io_service_ ) );
+    }
+
+    LOG ( INFO ) << "jpeg transcoder: quality " << quality_
+                 << " max dimension " << max_dimension_
+                 << " threads " << threads;
+}
+
+jpeg_transcoder::~jpeg_transcoder()
+{
+    work_.reset();
+    io_service_.stop();
+    workers_.join_all();
+}
+
+vector< path >
+jpeg_transcoder::transcode_all ( vector< path > const& files )
+{
+    if ( !enabled_ )
+        return files;
+
+    vector< std::future< path > > results;
+    BOOST_FOREACH ( auto const& file, files )
+    {
+        auto task = make_shared< std::packaged_task< path() > > (
+            boost::bind ( &jpeg_transcoder::transcode, this, file ) );
+        results.push_back ( task->get_future() );
+        io_service_.post ( [ task ] { ( *task ) (); } );
+    }
+
+    vector< path > transcoded;
+    BOOST_FOREACH ( auto& result, results )
+    {
+        transcoded.push_back ( result.get() );
+    }
+
+    return transcoded;
+}
+
+path
+jpeg_transcoder::transcode ( path const& original )
+{
+    auto extension = boost::algorithm::to_lower_copy ( original.extension().string() );
+    if ( extension.compare ( ".jpg" ) != 0 && extension.compare ( ".jpeg" ) != 0 )
+        return original;
+
+    auto cached = cached_path ( original );
+    boost::system::error_code ec;
+    if ( exists ( cached, ec )
+         && last_write_time ( cached, ec ) >= last_write_time ( original, ec ) )
+        return cached;
+
+    // Write under a temporary name so a crash never leaves a truncated
+    // file that looks like a valid cache entry.
+    path partial = cached;
+    partial += ".part";
+
+    if ( !recompress ( original.string(), partial.string(), quality_, max_dimension_ ) )
+    {
+        LOG ( WARNING ) << "Could not transcode " << original << ", uploading original.";
+        remove ( partial, ec );
+        return original;
+    }
+
+    auto before = file_size ( original, ec );
+    auto after = file_size ( partial, ec );
+    if ( ec || after >= before )
+    {
+        remove ( partial, ec );
+        return original;
+    }
+
+    rename ( partial, cached, ec );
+    if ( ec )
+        return original;
+
+    global::stat_add ( "transcode.bytes_in", before );
+    global::stat_add ( "transcode.bytes_out", after );
+
+    return cached;
+}
+
+path
+jpeg_transcoder::cached_path ( path const& original ) const
+{
+    ostringstream name;
+    name << original.stem().string()
+         << ".q" << quality_ << "-" << max_dimension_ << ".jpg";
+    return original.parent_path() / name.str();
+}
+
+shared_ptr< jpeg_transcoder >
+get_default_transcoder()
+{
+    static boost::mutex mutex;
+    static shared_ptr< jpeg_transcoder > transcoder;
+
+    boost::mutex::scoped_lock lock ( mutex );
+    if ( !transcoder )
+        transcoder.reset ( new jpeg_transcoder ( *global::config() ) );
+
+    return transcoder;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef TRANSCODER_HPP
+#define TRANSCODER_HPP
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+namespace asio = boost::asio;
+using namespace boost::filesystem;
+using boost::property_tree::ptree;
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+
+// Downscales and recompresses JPEG evidence before it is queued for
+// upload. Results are cached next to the originals, named after the
+// settings that produced them, so re-running an event costs nothing.
+class jpeg_transcoder : boost::noncopyable
+{
+public:
+    jpeg_transcoder ( ptree const & );
+    ~jpeg_transcoder();
+
+    bool enabled() const { return enabled_; }
+
+    // Transcodes the files on the worker pool and returns, in the same
+    // order, the path to upload for each one. Files that are not JPEGs or
+    // fail to transcode are returned unchanged.
+    vector< path > transcode_all ( vector< path > const & );
+    path transcode ( path const & );
+
+private:
+    path cached_path ( path const & ) const;
+
+private:
+    bool enabled_;
+    int quality_;
+    int max_dimension_;
+    asio::io_service io_service_;
+    boost::scoped_ptr< asio::io_service::work > work_;
+    boost::thread_group workers_;
+};
+
+shared_ptr< jpeg_transcoder > get_default_transcoder();
+
+}
+
+#endif
@@ -0,0 +1,477 @@
+#include "upload_engine.hpp"
+#include "global.hpp"
+
+#include <glog/logging.h>
+#include <json/json.h>
+
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace app
+{
+
+using boost::chrono::steady_clock;
+using boost::make_shared;
+using std::ifstream;
+
+upload_engine::upload_engine ( size_t max_in_flight )
+    : max_in_flight_ ( max_in_flight > 0 ? max_in_flight : 1 )
+{
+    chunk_url_ = global::config()->get ( "upload.chunk_url", "" );
+
+    // A redirect to the login page means the session has expired.
+    auto login_url = global::config()->get ( "login.url", "" );
+    auto host = login_url.find ( "://" );
+    auto slash = login_url.find ( '/', host == string::npos ? 0 : host + 3 );
+    login_path_ = slash == string::npos ? "" : login_url.substr ( slash );
+    chunk_size_ = std::max ( global::config()->get ( "upload.chunk_size", 1048576LL ), 1LL );
+    chunk_threshold_ = global::config()->get ( "upload.chunk_threshold", 4194304LL );
+    limiter_.load ( *global::config() );
+
+    // Cookies are shared so that every transfer rides on the session the
+    // uploader logged in with.
+    share_ = curl_share_init();
+    curl_share_setopt ( share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE );
+    curl_share_setopt ( share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+
+    multi_ = curl_multi_init();
+    curl_multi_setopt ( multi_, CURLMOPT_MAXCONNECTS, ( long ) max_in_flight_ );
+}
+
+upload_engine::~upload_engine()
+{
+    BOOST_FOREACH ( auto curl, idle_handles_ )
+    {
+        curl_easy_cleanup ( curl );
+    }
+    curl_multi_cleanup ( multi_ );
+    curl_share_cleanup ( share_ );
+}
+
+void
+upload_engine::run ( vector< upload_row > const& rows,
+                     completion_handler handler, progress_handler progress )
+{
+    size_t next = 0;
+    bool failed = false;
+
+    while ( next < rows.size() && transfers_.size() < max_in_flight_ )
+    {
+        if ( !launch ( rows[next], rows[next].sent_bytes ) )
+            handler ( rows[next], upload_failed );
+        ++next;
+    }
+
+    while ( !transfers_.empty() )
+    {
+        int running = 0;
+        curl_multi_perform ( multi_, &running );
+
+        CURLMsg* msg;
+        int msgs_left = 0;
+        while ( ( msg = curl_multi_info_read ( multi_, &msgs_left ) ) )
+        {
+            if ( msg->msg != CURLMSG_DONE )
+                continue;
+
+            transfer* t = nullptr;
+            curl_easy_getinfo ( msg->easy_handle, CURLINFO_PRIVATE, &t );
+            auto result = finish ( *t, msg->data.result, handler, progress );
+
+            // Once a transfer fails the server is likely unreachable or the
+            // session is gone, so let the ones in flight finish but do not
+            // start new ones.
+            if ( result != upload_ok )
+                failed = true;
+
+            while ( !failed && next < rows.size()
+                    && transfers_.size() < max_in_flight_ )
+            {
+                if ( !launch ( rows[next], rows[next].sent_bytes ) )
+                    handler ( rows[next], upload_failed );
+                ++next;
+            }
+        }
+
+        // Paused transfers are retried at a short interval so that they
+        // pick up tokens soon after the buckets refill.
+        bool throttled = std::any_of ( transfers_.begin(), transfers_.end(),
+            [] ( shared_ptr< transfer > const& p ) { return p->paused; } );
+        resume_paused();
+
+        if ( !transfers_.empty() )
+            curl_multi_wait ( multi_, NULL, 0, throttled ? 50 : 1000, NULL );
+    }
+}
+
+void
+upload_engine::resume_paused()
+{
+    auto now = steady_clock::now();
+
+    BOOST_FOREACH ( auto const& t, transfers_ )
+    {
+        if ( !t->paused )
+            continue;
+
+        t->paused = false;
+        global::stat_add ( "upload.throttled_ms." + t->type,
+            boost::chrono::duration_cast< boost::chrono::milliseconds > (
+                now - t->paused_at ).count() );
+        curl_easy_pause ( t->curl, CURLPAUSE_CONT );
+    }
+}
+
+bool
+upload_engine::launch ( upload_row const& row, long long offset )
+{
+    auto t = make_shared< transfer >();
+    t->curl = acquire_handle();
+    t->formpost = NULL;
+    t->row = &row;
+    t->chunked = false;
+    t->offset = offset;
+    t->total = 0;
+    t->engine = this;
+    t->type = row.type;
+    t->body_size = 0;
+    t->body_pos = 0;
+    t->paused = false;
+
+    auto const& type = row.type;
+    auto const& timestamp = row.timestamp;
+    auto const& device = row.device;
+    auto const& file_path = row.upload_file;
+    auto site = global::config()->get ( "node.site", "invalid-site" );
+    auto node_name = global::config()->get ( "node.name", "invalid-node-name" );
+
+    struct curl_httppost* lastptr = NULL;
+
+    // The server already holds this blob through another event: tell it
+    // that this event includes it too, by digest, without the bytes.
+    bool reference = row.acknowledged && !row.digest.empty();
+
+    if ( !reference && type.compare ( "loitering" ) == 0 && !chunk_url_.empty() )
+    {
+        boost::system::error_code ec;
+        t->total = boost::filesystem::file_size ( file_path, ec );
+        t->chunked = !ec && t->total > chunk_threshold_;
+    }
+
+    if ( t->chunked )
+    {
+        if ( !add_chunk ( *t, file_path ) )
+            t->chunked = false;
+    }
+
+    if ( t->chunked )
+    {
+        // Identify the file across chunks and restarts by node and row id.
+        auto upload_id = node_name + "-" + row.id;
+        auto file_name = boost::filesystem::path ( file_path ).filename().string();
+        auto offset_str = std::to_string ( t->offset );
+        auto total_str = std::to_string ( t->total );
+
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "uploadId",
+                       CURLFORM_COPYCONTENTS, upload_id.c_str(),
+                       CURLFORM_END );
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "fileName",
+                       CURLFORM_COPYCONTENTS, file_name.c_str(),
+                       CURLFORM_END );
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "offset",
+                       CURLFORM_COPYCONTENTS, offset_str.c_str(),
+                       CURLFORM_END );
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "totalSize",
+                       CURLFORM_COPYCONTENTS, total_str.c_str(),
+                       CURLFORM_END );
+        t->body_size = t->chunk.size();
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "chunk",
+                       CURLFORM_FILENAME, file_name.c_str(),
+                       CURLFORM_CONTENTTYPE, "application/octet-stream",
+                       CURLFORM_STREAM, t.get(),
+                       CURLFORM_CONTENTSLENGTH, ( long ) t->body_size,
+                       CURLFORM_END );
+    }
+    else if ( reference )
+    {
+        global::stat_add ( "upload.references", 1 );
+    }
+    else if ( type.compare ( "loitering" ) == 0 )
+    {
+        boost::system::error_code ec;
+        auto file_name = boost::filesystem::path ( file_path ).filename().string();
+        auto extension = boost::filesystem::path ( file_path ).extension().string();
+        bool jpeg = extension.compare ( ".jpg" ) == 0 || extension.compare ( ".jpeg" ) == 0;
+        bool bundle = extension.compare ( ".tar" ) == 0;
+
+        t->body_size = boost::filesystem::file_size ( file_path, ec );
+        t->file.open ( file_path, ifstream::binary );
+        if ( ec || !t->file )
+        {
+            // Posting an empty attachment would mark the row sent.
+            LOG ( ERROR ) << "Could not open " << file_path << " for upload.";
+            idle_handles_.push_back ( t->curl );
+            return false;
+        }
+
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "attachment",
+                       CURLFORM_FILENAME, file_name.c_str(),
+                       CURLFORM_CONTENTTYPE, jpeg ? "image/jpeg"
+                           : bundle ? "application/x-tar" : "application/octet-stream",
+                       CURLFORM_STREAM, t.get(),
+                       CURLFORM_CONTENTSLENGTH, ( long ) t->body_size,
+                       CURLFORM_END );
+    }
+    else if ( type.compare ( "health" ) == 0 )
+    {
+        // Health reports also carry the node's database footprint, as
+        // last measured by the retention job.
+        auto stats = global::stats();
+        auto db_size = stats.get ( ptree::path_type ( "db.size_bytes", '/' ), string ( "0" ) );
+        auto reclaimed = stats.get ( ptree::path_type ( "db.pages_reclaimed", '/' ), string ( "0" ) );
+
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "status",
+                       CURLFORM_COPYCONTENTS, file_path.c_str(),
+                       CURLFORM_END );
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "dbSize",
+                       CURLFORM_COPYCONTENTS, db_size.c_str(),
+                       CURLFORM_END );
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "dbReclaimedPages",
+                       CURLFORM_COPYCONTENTS, reclaimed.c_str(),
+                       CURLFORM_END );
+    }
+
+    curl_formadd ( &t->formpost, &lastptr,
+                   CURLFORM_COPYNAME, "type",
+                   CURLFORM_COPYCONTENTS, type.c_str(),
+                   CURLFORM_END );
+    curl_formadd ( &t->formpost, &lastptr,
+                   CURLFORM_COPYNAME, "site",
+                   CURLFORM_COPYCONTENTS, site.c_str(),
+                   CURLFORM_END );
+    curl_formadd ( &t->formpost, &lastptr,
+                   CURLFORM_COPYNAME, "nodeName",
+                   CURLFORM_COPYCONTENTS, node_name.c_str(),
+                   CURLFORM_END );
+    curl_formadd ( &t->formpost, &lastptr,
+                   CURLFORM_COPYNAME, "device",
+                   CURLFORM_COPYCONTENTS, device.c_str(),
+                   CURLFORM_END );
+    curl_formadd ( &t->formpost, &lastptr,
+                   CURLFORM_COPYNAME, "timestamp",
+                   CURLFORM_COPYCONTENTS, timestamp.c_str(),
+                   CURLFORM_END );
+    if ( !row.digest.empty() )
+    {
+        curl_formadd ( &t->formpost, &lastptr,
+                       CURLFORM_COPYNAME, "digest",
+                       CURLFORM_COPYCONTENTS, row.digest.c_str(),
+                       CURLFORM_END );
+    }
+
+    string upload_url;
+    if ( t->chunked )
+        upload_url = chunk_url_;
+    else if ( type.compare ( "loitering" ) == 0 )
+        upload_url = global::config()->get ( "upload.url", "missing" );
+    else if ( type.compare ( "health" ) == 0 )
+        upload_url = global::config()->get ( "report.url", "missing" );
+
+    curl_easy_setopt ( t->curl, CURLOPT_URL, upload_url.c_str() );
+    curl_easy_setopt ( t->curl, CURLOPT_HEADER, 0L );
+    curl_easy_setopt ( t->curl, CURLOPT_WRITEFUNCTION, &upload_engine::reply_callback );
+    curl_easy_setopt ( t->curl, CURLOPT_WRITEDATA, t.get() );
+    curl_easy_setopt ( t->curl, CURLOPT_READFUNCTION, &upload_engine::body_callback );
+    curl_easy_setopt ( t->curl, CURLOPT_PRIVATE, t.get() );
+    curl_easy_setopt ( t->curl, CURLOPT_HTTPPOST, t->formpost );
+
+    transfers_.push_back ( t );
+    curl_multi_add_handle ( multi_, t->curl );
+    return true;
+}
+
+bool
+upload_engine::add_chunk ( transfer& t, string const& file_path )
+{
+    if ( t.offset < 0 || t.offset >= t.total )
+        t.offset = 0;
+
+    auto length = std::min ( chunk_size_, t.total - t.offset );
+    t.chunk.resize ( length );
+
+    ifstream ifs ( file_path, ifstream::binary );
+    ifs.seekg ( t.offset );
+    if ( !ifs.read ( t.chunk.data(), length ) )
+    {
+        LOG ( ERROR ) << "Could not read chunk at " << t.offset << " of " << file_path;
+        return false;
+    }
+
+    return true;
+}
+
+upload_status
+upload_engine::finish ( transfer& t, CURLcode result,
+                        completion_handler& handler, progress_handler& progress )
+{
+    upload_status status = upload_failed;
+    long long acknowledged = 0;
+
+    if ( result == CURLE_OK )
+    {
+        LOG ( INFO ) << t.reply;
+
+        long response_code = 0;
+        curl_easy_getinfo ( t.curl, CURLINFO_RESPONSE_CODE, &response_code );
+
+        Json::Value root;
+        Json::Reader reader;
+
+        // Only an auth error or a redirect to the login page means the
+        // session expired. Error pages from a proxy or the backend (5xx,
+        // 413, anything that is not JSON) are failures, so the row backs
+        // off and the breaker sees them.
+        char* redirect = NULL;
+        curl_easy_getinfo ( t.curl, CURLINFO_REDIRECT_URL, &redirect );
+
+        if ( response_code == 401 || response_code == 403 )
+            status = upload_rejected;
+        else if ( response_code >= 300 && response_code < 400 )
+            status = redirect && !login_path_.empty()
+                     && string ( redirect ).find ( login_path_ ) != string::npos
+                     ? upload_rejected : upload_failed;
+        else if ( response_code >= 400 )
+            status = upload_failed;
+        else if ( !reader.parse ( t.reply, root ) || !root.isObject() )
+            status = upload_failed;
+        else if ( root.get ( "result", "error" ).asString().compare ( "ok" ) == 0 )
+        {
+            status = upload_ok;
+            if ( t.chunked )
+                acknowledged = static_cast< long long > ( root.get ( "offset", 0 ).asDouble() );
+        }
+    }
+    else
+    {
+        LOG ( INFO ) << "Upload of event " << t.row->id
+                     << " failed: " << curl_easy_strerror ( result );
+    }
+
+    curl_multi_remove_handle ( multi_, t.curl );
+    curl_formfree ( t.formpost );
+    idle_handles_.push_back ( t.curl );
+
+    // An acknowledgement that does not move the offset would resend the
+    // same chunk forever.
+    if ( t.chunked && status == upload_ok && acknowledged == t.offset )
+    {
+        LOG ( INFO ) << "Chunk at " << t.offset << " of event "
+                     << t.row->id << " was not acknowledged.";
+        status = upload_failed;
+    }
+
+    upload_row const& row = *t.row;
+    bool chunked = t.chunked;
+    long long total = t.total;
+    transfers_.erase ( std::find_if ( transfers_.begin(), transfers_.end(),
+        [ &t ] ( shared_ptr< transfer > const& p ) { return p.get() == &t; } ) );
+
+    // A chunk that left the file incomplete keeps its slot and goes on
+    // with the offset the server acknowledged.
+    if ( chunked && status == upload_ok && acknowledged < total )
+    {
+        progress ( row, acknowledged );
+        if ( launch ( row, acknowledged ) )
+            return status;
+        status = upload_failed;
+    }
+
+    handler ( row, status );
+
+    return status;
+}
+
+CURL*
+upload_engine::acquire_handle()
+{
+    CURL* curl;
+
+    if ( !idle_handles_.empty() )
+    {
+        curl = idle_handles_.back();
+        idle_handles_.pop_back();
+        curl_easy_reset ( curl );
+    }
+    else
+    {
+        curl = curl_easy_init();
+        if ( !curl )
+            LOG ( ERROR ) << "a CURL instance could not be instantiated.";
+    }
+
+    curl_easy_setopt ( curl, CURLOPT_SHARE, share_ );
+    curl_easy_setopt ( curl, CURLOPT_COOKIEFILE, "" );
+    curl_easy_setopt ( curl, CURLOPT_NOSIGNAL, 1L );
+
+    return curl;
+}
+
+size_t
+upload_engine::reply_callback ( void* ptr, size_t size, size_t nmemb, void* userdata )
+{
+    auto realsize = size * nmemb;
+    auto t = ( transfer* ) userdata;
+    t->reply.append ( ( char* ) ptr, realsize );
+    return realsize;
+}
+
+size_t
+upload_engine::body_callback ( char* buffer, size_t size, size_t nitems, void* userdata )
+{
+    auto t = ( transfer* ) userdata;
+    size_t wanted = static_cast< size_t > ( std::min< long long > (
+        size * nitems, t->body_size - t->body_pos ) );
+
+    if ( wanted == 0 )
+        return 0;
+
+    size_t granted = t->engine->limiter_.acquire ( t->type, wanted );
+    if ( granted == 0 )
+    {
+        t->paused = true;
+        t->paused_at = steady_clock::now();
+        return CURL_READFUNC_PAUSE;
+    }
+
+    if ( t->chunked )
+    {
+        std::memcpy ( buffer, t->chunk.data() + t->body_pos, granted );
+    }
+    else if ( !t->file.read ( buffer, granted ) )
+    {
+        LOG ( ERROR ) << "Could not read upload body at " << t->body_pos;
+        return CURL_READFUNC_ABORT;
+    }
+
+    t->body_pos += granted;
+    global::stat_add ( "upload.bytes_sent." + t->type, granted );
+
+    return granted;
+}
+
+}
@@ -0,0 +1,109 @@
+#ifndef UPLOAD_ENGINE_HPP
+#define UPLOAD_ENGINE_HPP
+
+#include "rate_limiter.hpp"
+#include "upload_row.hpp"
+
+#include <curl/curl.h>
+
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+
+// Outcome of one transfer. upload_rejected means the server refused the
+// session cookie and the uploader has to log in again.
+enum upload_status
+{
+    upload_ok,
+    upload_failed,
+    upload_rejected
+};
+
+// Sends upload rows over a curl multi handle, keeping up to max_in_flight
+// transfers running at once. The completion handler is called once per row
+// from the thread that calls run(). The multi handle and its connection
+// cache live as long as the engine, so keep-alive connections carry over
+// from one batch to the next.
+//
+// When upload.chunk_url is configured, media files larger than
+// upload.chunk_threshold are sent to it in upload.chunk_size pieces, one
+// piece per request, starting at the row's sent_bytes. The server answers
+// each piece with the offset it has stored, which is reported through the
+// progress handler so an interrupted file resumes from there.
+//
+// Every file is sent with the sha256 digest of its blob. A row whose
+// blob the server already holds through another event is sent as a
+// reference: the event fields and the digest, without an attachment, so
+// the server links the file to this event as well.
+//
+// File bodies are streamed through a read callback that takes tokens from
+// the rate limiter; a transfer that runs out of tokens is paused and
+// resumed once the buckets have refilled.
+class upload_engine : boost::noncopyable
+{
+public:
+    typedef boost::function< void ( upload_row const &, upload_status ) > completion_handler;
+    typedef boost::function< void ( upload_row const &, long long ) > progress_handler;
+
+    upload_engine ( size_t max_in_flight );
+    ~upload_engine();
+
+    void run ( vector< upload_row > const &, completion_handler, progress_handler );
+    CURLSH* share() const { return share_; }
+
+private:
+    struct transfer
+    {
+        CURL* curl;
+        struct curl_httppost* formpost;
+        upload_row const* row;
+        string reply;
+        bool chunked;
+        long long offset;
+        long long total;
+        vector< char > chunk;
+        upload_engine* engine;
+        string type;
+        std::ifstream file;
+        long long body_size;
+        long long body_pos;
+        bool paused;
+        boost::chrono::steady_clock::time_point paused_at;
+    };
+
+    bool launch ( upload_row const &, long long );
+    bool add_chunk ( transfer &, string const & );
+    upload_status finish ( transfer &, CURLcode, completion_handler &, progress_handler & );
+    void resume_paused();
+    CURL* acquire_handle();
+    static size_t reply_callback ( void*, size_t, size_t, void* );
+    static size_t body_callback ( char*, size_t, size_t, void* );
+
+private:
+    size_t max_in_flight_;
+    string chunk_url_;
+    string login_path_;
+    long long chunk_size_;
+    long long chunk_threshold_;
+    CURLM* multi_;
+    CURLSH* share_;
+    rate_limiter limiter_;
+    vector< CURL* > idle_handles_;
+    vector< shared_ptr< transfer > > transfers_;
+};
+
+}
+
+#endif
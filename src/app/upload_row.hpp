@@ -0,0 +1,33 @@
+#ifndef UPLOAD_ROW_HPP
+#define UPLOAD_ROW_HPP
+
+#include <string>
+
+namespace app
+{
+
+using std::string;
+
+// The fields of an uploads row the uploader works with, as read by the
+// scheduler. digest is empty for rows without a stored blob; acknowledged
+// is set when the server already holds the blob through another row, and
+// the row only has to be sent as a reference to it.
+struct upload_row
+{
+    upload_row() : attempts ( 0 ), sent_bytes ( 0 ), acknowledged ( false ) {}
+
+    string id;
+    string timestamp;
+    string type;
+    string reporter;
+    string device;
+    string upload_file;
+    string digest;
+    int attempts;
+    long long sent_bytes;
+    bool acknowledged;
+};
+
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include "upload_scheduler.hpp"
+#include "database.hpp"
+
+#include <glog/logging.h>
+
+#include <boost/foreach.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <set>
+#include <sstream>
+
+namespace app
+{
+
+using std::deque;
+using std::ostringstream;
+using std::set;
+
+void
+upload_scheduler::load ( ptree const& config )
+{
+    LOG ( INFO ) << "Loading upload class configurations...";
+
+    levels_.clear();
+    known_types_.clear();
+
+    BOOST_FOREACH ( ptree::value_type const& section, config )
+    {
+        string name ( section.first.data() );
+        if ( name.find ( "upload-class-" ) != 0 )
+            continue;
+
+        upload_class a_class;
+        a_class.type = name.substr ( string ( "upload-class-" ).length() );
+        a_class.priority = section.second.get ( "priority", 1 );
+        a_class.weight = std::max ( section.second.get< size_t > ( "weight", 1 ), size_t ( 1 ) );
+        a_class.batch_limit = section.second.get< size_t > ( "batch_limit", 0 );
+        a_class.deficit = 0;
+
+        LOG ( INFO ) << "upload class: " << a_class.type
+                     << " priority: " << a_class.priority
+                     << " weight: " << a_class.weight
+                     << " batch_limit: " << a_class.batch_limit;
+
+        levels_[a_class.priority].push_back ( a_class );
+        known_types_.push_back ( a_class.type );
+    }
+
+    // Types without a section of their own share one default class.
+    default_class_.type = "";
+    default_class_.priority = config.get ( "upload.default_priority", 1 );
+    default_class_.weight = 1;
+    default_class_.batch_limit = 0;
+    default_class_.deficit = 0;
+    levels_[default_class_.priority].push_back ( default_class_ );
+}
+
+vector< upload_row >
+upload_scheduler::next_batch ( size_t batch_size, bool& more )
+{
+    vector< upload_row > batch;
+    set< string > digests;
+    more = false;
+
+    for ( auto level = levels_.begin();
+          level != levels_.end() && batch.size() < batch_size; ++level )
+    {
+        auto& classes = level->second;
+        size_t remaining = batch_size - batch.size();
+
+        // Fetch candidates for every class at this level, then hand out
+        // the free slots with deficit round robin so that each class gets
+        // a share proportional to its weight over successive batches.
+        vector< deque< upload_row > > candidates;
+        BOOST_FOREACH ( auto const& c, classes )
+        {
+            size_t limit = c.batch_limit > 0 ? std::min ( c.batch_limit, remaining ) : remaining;
+            auto rows = pending_rows ( c, limit );
+            if ( rows.size() == limit )
+                more = true;
+            candidates.push_back ( deque< upload_row > (
+                std::make_move_iterator ( rows.begin() ),
+                std::make_move_iterator ( rows.end() ) ) );
+        }
+
+        bool progress = true;
+        while ( batch.size() < batch_size && progress )
+        {
+            progress = false;
+            for ( size_t i = 0; i < classes.size() && batch.size() < batch_size; ++i )
+            {
+                if ( candidates[i].empty() )
+                {
+                    // An idle class does not bank credit for later.
+                    classes[i].deficit = 0;
+                    continue;
+                }
+
+                classes[i].deficit += classes[i].weight;
+                while ( classes[i].deficit >= 1 && !candidates[i].empty()
+                        && batch.size() < batch_size )
+                {
+                    // Send each blob once per batch; later rows sharing it
+                    // wait until it is acknowledged and are then skipped.
+                    auto const& row = candidates[i].front();
+                    if ( !row.digest.empty() && !row.acknowledged
+                         && !digests.insert ( row.digest ).second )
+                    {
+                        candidates[i].pop_front();
+                        more = true;
+                        continue;
+                    }
+
+                    batch.push_back ( std::move ( candidates[i].front() ) );
+                    candidates[i].pop_front();
+                    classes[i].deficit -= 1;
+                    progress = true;
+                }
+            }
+        }
+
+        BOOST_FOREACH ( auto const& left, candidates )
+        {
+            if ( !left.empty() )
+                more = true;
+        }
+    }
+
+    // Levels not reached because the batch filled up may hold rows too.
+    if ( batch.size() == batch_size )
+        more = true;
+
+    return batch;
+}
+
+vector< upload_row >
+upload_scheduler::pending_rows ( upload_class const& c, size_t limit )
+{
+    vector< upload_row > rows;
+    ostringstream query;
+
+    // Rows that failed before wait out their backoff delay.
+    // Blobs the server already acknowledged through another row come back
+    // flagged so the uploader sends them as references, without the bytes.
+    query << "SELECT uploads.*, IFNULL(blobs.uploaded, 0) FROM uploads"
+          << " LEFT JOIN blobs ON blobs.digest=uploads.digest"
+          << " WHERE uploads.uploaded=0"
+          << " AND (next_attempt IS NULL OR next_attempt <= datetime('now'))";
+    if ( !c.type.empty() )
+    {
+        query << " AND type=?";
+    }
+    else if ( !known_types_.empty() )
+    {
+        query << " AND type NOT IN (";
+        for ( size_t i = 0; i < known_types_.size(); ++i )
+            query << ( i ? ",?" : "?" );
+        query << ")";
+    }
+    query << " ORDER BY uploads.id LIMIT ?";
+
+    // The text only depends on the class, so each class compiles once.
+    statement select ( query.str() );
+    int index = 1;
+    if ( !c.type.empty() )
+    {
+        select.bind ( index++, c.type );
+    }
+    else
+    {
+        BOOST_FOREACH ( auto const& type, known_types_ )
+        {
+            select.bind ( index++, type );
+        }
+    }
+    select.bind ( index, static_cast< long long > ( limit ) );
+
+    while ( select.step() )
+    {
+        upload_row row;
+        row.id = select.column_text ( 0 );
+        row.timestamp = select.column_text ( 1 );
+        row.type = select.column_text ( 2 );
+        row.reporter = select.column_text ( 3 );
+        row.device = select.column_text ( 4 );
+        row.upload_file = select.column_text ( 5 );
+        row.attempts = select.column_int ( 7 );
+        row.sent_bytes = select.column_int64 ( 9 );
+        if ( !select.column_null ( 10 ) )
+        {
+            row.digest = select.column_text ( 10 );
+        }
+        row.acknowledged = select.column_int ( 11 ) != 0;
+        rows.push_back ( std::move ( row ) );
+    }
+
+    return rows;
+}
+
+}
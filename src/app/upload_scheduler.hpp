@@ -0,0 +1,59 @@
+#ifndef UPLOAD_SCHEDULER_HPP
+#define UPLOAD_SCHEDULER_HPP
+
+#include "upload_row.hpp"
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/utility.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace app
+{
+
+using boost::property_tree::ptree;
+using std::map;
+using std::string;
+using std::vector;
+
+// Scheduling class of one upload type, read from an [upload-class-<type>]
+// section. Lower priority values are served first; types sharing a
+// priority split the batch according to their weights.
+struct upload_class
+{
+    string type;
+    int priority;
+    size_t weight;
+    size_t batch_limit;
+    double deficit;
+};
+
+// Picks the rows of the next upload batch out of the uploads table so
+// that small status rows are never stuck behind a backlog of media.
+class upload_scheduler : boost::noncopyable
+{
+public:
+    upload_scheduler() {}
+    ~upload_scheduler() {}
+
+    void load ( ptree const & );
+    // Sets more when rows were left pending that the next batch can take:
+    // a class had more rows than it was given, or rows were held back
+    // behind a blob in this batch.
+    vector< upload_row > next_batch ( size_t, bool& more );
+
+private:
+    vector< upload_row > pending_rows ( upload_class const &, size_t );
+
+private:
+    // Keyed by priority, so iteration visits the most urgent level first.
+    map< int, vector< upload_class > > levels_;
+    upload_class default_class_;
+    vector< string > known_types_;
+};
+
+}
+
+#endif
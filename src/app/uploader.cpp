@@ -1,18 +1,27 @@
+#include "circuit_breaker.hpp"
 #include "common.hpp"
+#include "database.hpp"
 #include "fsm.hpp"
 #include "global.hpp"
+#include "notifier.hpp"
+#include "upload_engine.hpp"
+#include "upload_scheduler.hpp"
 
 #include <qp_port.h>
 #include <curl/curl.h>
 #include <glog/logging.h>
-#include <json/json.h>
 #include <sqlite3.h>
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/regex.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -25,6 +34,7 @@ using namespace boost::posix_time;
 using boost::regex_search;
 using boost::smatch;
 using std::ostringstream;
+using std::pair;
 using std::string;
 using std::vector;
 
@@ -41,8 +51,11 @@ public:
     void clear_reply();
     void login();
     static size_t login_callback ( void*, size_t, size_t, void* );
-    void upload_event ();
-    static size_t upload_event_callback ( void*, size_t, size_t, void* );
+    void upload_batch();
+    void uploads_changed();
+    void upload_completed ( upload_row const&, upload_status );
+    void upload_progressed ( upload_row const&, long long );
+    long retry_delay ( int );
 
 private:
     CURL* curl_;
@@ -51,9 +64,21 @@ private:
     size_t content_length_;
     bool in_header_;
     bool logged_in_;
-    bool uploaded_;
-    ptree event_args_;
+    size_t batch_size_;
+    bool batch_failed_;
+    bool server_failed_;
+    bool more_pending_;
+    vector< std::pair< string, int > > failed_ids_;
+    long retry_interval_;
+    long max_retry_interval_;
+    std::mt19937 rng_;
+    boost::scoped_ptr< circuit_breaker > breaker_;
+    boost::scoped_ptr< upload_engine > engine_;
+    upload_scheduler scheduler_;
+    vector< upload_row > batch_;
+    vector< string > uploaded_ids_;
     boost::thread worker_thread_;
+    std::atomic< bool > wake_pending_;
 
 protected:
     static QP::QState initial ( uploader* const, QP::QEvt const* const );
@@ -67,22 +92,54 @@ protected:
 uploader::uploader()
     : QActive ( Q_STATE_CAST ( &uploader::initial ) ),
       timeout_ ( EVT_TIMEOUT ),
-      event_upload_reminder_ ( EVT_EVENT_UPLOAD_REMINDER )
+      event_upload_reminder_ ( EVT_EVENT_UPLOAD_REMINDER ),
+      more_pending_ ( false ),
+      wake_pending_ ( false )
 {
 }
 
+// Called on the writer thread when rows were added to uploads. Only one
+// wakeup is kept in flight, however many rows were committed meanwhile.
+void uploader::uploads_changed()
+{
+    if ( !wake_pending_.exchange ( true ) )
+    {
+        auto evt = Q_NEW ( gevt, EVT_EVENT_UPLOAD_REMINDER );
+        postFIFO ( evt );
+    }
+}
+
 // initial
 QP::QState uploader::initial ( uploader* const me, QP::QEvt const* const
                                e )
 {
     me->controller_ = global::get_default_controller();
     me->vca_manager_ = global::get_default_vca_manager();
+    me->batch_size_ = global::config()->get ( "upload.batch_size", 20 );
+    if ( me->batch_size_ == 0 )
+        me->batch_size_ = 1;
+    me->scheduler_.load ( *global::config() );
+
+    me->retry_interval_ = global::config()->get ( "upload.retry_interval", 3 );
+    me->max_retry_interval_ = global::config()->get ( "upload.max_retry_interval", 3600 );
+    me->rng_.seed ( std::random_device()() );
+    me->breaker_.reset ( new circuit_breaker (
+        global::config()->get ( "upload.breaker_threshold", 3 ),
+        seconds ( global::config()->get ( "upload.breaker_cooldown", 30 ) ),
+        seconds ( global::config()->get ( "upload.max_breaker_cooldown", 600 ) ) ) );
+
+    me->engine_.reset ( new upload_engine (
+        global::config()->get ( "upload.max_in_flight", 4 ) ) );
 
     me->curl_ = curl_easy_init();
     if ( !me->curl_ )
     {
         LOG ( ERROR ) << "a CURL instance could not be instantiated.";
     }
+    curl_easy_setopt ( me->curl_, CURLOPT_SHARE, me->engine_->share() );
+    me->logged_in_ = false;
+
+    subscribe_changes ( "uploads", boost::bind ( &uploader::uploads_changed, me ) );
 
     return Q_TRAN ( &uploader::idle );
 }
@@ -119,55 +176,46 @@ QP::QState uploader::idle ( uploader* const me, QP::QEvt const* const e )
     {
     case Q_ENTRY_SIG:
     {
+        // New rows wake the uploader through the change notifier; the
+        // reminder only remains as a slow safety net and to pick up rows
+        // whose retry time has come.
         auto remind_interval = SECONDS (
-            global::config()->get ( "upload.remind_interval", 1 ) );
+            global::config()->get ( "upload.remind_interval", 10 ) );
         me->event_upload_reminder_.postEvery ( me, remind_interval );
+
+        // A wakeup that arrived while a batch was in flight was dropped.
+        if ( me->wake_pending_ )
+        {
+            auto evt = Q_NEW ( gevt, EVT_EVENT_UPLOAD_REMINDER );
+            me->postFIFO ( evt );
+        }
         status = Q_HANDLED();
         break;
     }
 
     case EVT_EVENT_UPLOAD_REMINDER:
     {
-        // Check if there are yet-to-be-uploaded events in the database.
-        auto sql = global::get_database_handle();
-        sqlite3_stmt* stmt;
-
-        char const * query = "SELECT * FROM uploads WHERE uploaded=0";
-        sqlite3_prepare_v2(sql, query, strlen(query) + 1, &stmt, NULL );
+        me->wake_pending_ = false;
 
-        int retval = sqlite3_step(stmt);
-        if (retval == SQLITE_ROW)
+        // While the breaker is open nothing is attempted; once it lets a
+        // probe through, the probe is a single row.
+        if ( !me->breaker_->allow() )
         {
-            auto evt = Q_NEW(gevt, EVT_UPLOAD_EVENT);
-            evt->args.put(
-                "id",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 0)))
-            );
-            evt->args.put(
-                "timestamp",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 1)))
-            );
-            evt->args.put(
-                "type",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 2)))
-            );
-            evt->args.put(
-                "reporter",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 3)))
-            );
-            evt->args.put(
-                "device",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 4)))
-            );
-            evt->args.put(
-                "upload_file",
-                string(reinterpret_cast<const char *> (sqlite3_column_text(stmt, 5)))
-            );
-
-            me->postFIFO(evt);
+            status = Q_HANDLED();
+            break;
         }
 
-        sqlite3_finalize(stmt);
+        // Let the scheduler pick up to batch_size pending rows, most
+        // urgent upload classes first.
+        auto rows = me->scheduler_.next_batch (
+            me->breaker_->probing() ? 1 : me->batch_size_, me->more_pending_ );
+
+        if ( !rows.empty() )
+        {
+            auto evt = Q_NEW ( upload_evt, EVT_UPLOAD_EVENT );
+            evt->rows.swap ( rows );
+            me->postFIFO ( evt );
+        }
 
         status = Q_HANDLED();
         break;
@@ -175,16 +223,20 @@ QP::QState uploader::idle ( uploader* const me, QP::QEvt const* const e )
 
     case EVT_UPLOAD_EVENT:
     {
-        auto evt = static_cast< gevt const* const > ( e );
-        LOG ( INFO ) << "Uploading event: "
-                     << evt->args.get< string > ( "id" ) << ": "
-                     << evt->args.get< string > ( "timestamp" ) << ": "
-                     << evt->args.get< string > ( "type" ) << ": "
-                     << evt->args.get< string > ( "reporter" ) << ": "
-                     << evt->args.get< string > ( "device" );
-
-        me->event_args_.clear();
-        me->event_args_ = evt->args;
+        // The event was posted to this object alone, so its rows can be
+        // taken over rather than copied.
+        auto evt = const_cast< upload_evt* > ( static_cast< upload_evt const* > ( e ) );
+
+        me->batch_.clear();
+        me->batch_.swap ( evt->rows );
+        me->uploaded_ids_.clear();
+        me->failed_ids_.clear();
+        me->batch_failed_ = false;
+        me->server_failed_ = false;
+
+        LOG ( INFO ) << "Uploading batch of " << me->batch_.size() << " event(s), "
+                     << "first id: " << me->batch_.front().id;
+
         status = Q_TRAN ( &uploader::uploading_event );
         break;
     }
@@ -211,8 +263,14 @@ QP::QState uploader::uploading_event ( uploader* const me, QP::QEvt const* const
     {
     case Q_ENTRY_SIG:
     {
-        me->worker_thread_ = boost::thread (
-            boost::bind ( &uploader::login, me ) );
+        // The session cookie is kept in the shared jar between batches, so
+        // only log in when there is no session yet or it was rejected.
+        if ( me->logged_in_ )
+            me->worker_thread_ = boost::thread (
+                boost::bind ( &uploader::upload_batch, me ) );
+        else
+            me->worker_thread_ = boost::thread (
+                boost::bind ( &uploader::login, me ) );
 
         status = Q_HANDLED();
         break;
@@ -220,39 +278,133 @@ QP::QState uploader::uploading_event ( uploader* const me, QP::QEvt const* const
 
     case EVT_LOGGED_IN:
         me->worker_thread_ = boost::thread (
-            boost::bind ( &uploader::upload_event , me ) );
+            boost::bind ( &uploader::upload_batch, me ) );
 
         status = Q_HANDLED();
         break;
 
     case EVT_LOGIN_FAILED:
+        me->breaker_->failed();
         status = Q_TRAN ( &uploader::idle );
         break;
 
+    case EVT_EVENT_UPLOADED:
+    {
+        auto evt = static_cast< upload_status_evt const* const > ( e );
+        me->uploaded_ids_.push_back ( evt->id );
+        status = Q_HANDLED();
+        break;
+    }
+
     case EVT_EVENT_UPLOAD_FAILED:
     {
-        status = Q_TRAN ( &uploader::idle );
+        auto evt = static_cast< upload_status_evt const* const > ( e );
+        if ( evt->rejected )
+        {
+            LOG ( INFO ) << "Session rejected by server, logging in again on next batch.";
+            me->logged_in_ = false;
+        }
+        else
+        {
+            me->failed_ids_.push_back ( std::make_pair ( evt->id, evt->attempts ) );
+            me->server_failed_ = true;
+        }
+        me->batch_failed_ = true;
+        status = Q_HANDLED();
         break;
     }
 
-    case EVT_EVENT_UPLOADED:
+    case EVT_UPLOAD_PROGRESS:
     {
-        // Update event status to uploaded in database.
-        auto sql = global::get_database_handle();
-        ostringstream stmt;
-        int error;
+        // Record how far a chunked upload got so it resumes from there
+        // after a dropped link or a restart.
+        auto evt = static_cast< upload_status_evt const* const > ( e );
+        auto sent_bytes = evt->sent_bytes;
+        auto id = evt->id;
+        submit_write ( [ sent_bytes, id ] {
+            statement update ( "UPDATE uploads set sent_bytes=? where id=?" );
+            if ( !update.bind ( 1, sent_bytes ).bind ( 2, id ).exec() )
+            {
+                LOG ( INFO ) << "Could not update upload progress in database.";
+                return false;
+            }
+            return true;
+        } );
 
-        string id = me->event_args_.get< string > ( "id" );
-        string type = me->event_args_.get< string > ( "type" );
+        status = Q_HANDLED();
+        break;
+    }
 
-        stmt << "UPDATE uploads set uploaded=1 where id=" << id;
+    case EVT_UPLOAD_BATCH_FINISHED:
+    {
+        // Mark every row the worker managed to send, and push back the
+        // next attempt of every row that failed, as one write. Wait for it
+        // to commit so the next batch cannot pick the same rows again.
+        if ( !me->uploaded_ids_.empty() || !me->failed_ids_.empty() )
+        {
+            auto uploaded_ids = me->uploaded_ids_;
+            vector< pair< string, string > > retries;
+            BOOST_FOREACH ( auto const& f, me->failed_ids_ )
+            {
+                retries.push_back ( std::make_pair ( f.first,
+                    "+" + std::to_string ( me->retry_delay ( f.second ) ) + " seconds" ) );
+            }
+
+            bool ok = execute_write ( [ uploaded_ids, retries ] {
+                statement uploaded ( "UPDATE uploads set uploaded=1 where id=?" );
+                statement blob ( "UPDATE blobs set uploaded=1"
+                    " where digest=(SELECT digest FROM uploads where id=?)" );
+                statement members ( "UPDATE blobs set uploaded=1 where digest IN"
+                    " (SELECT member FROM bundle_members WHERE bundle="
+                    "(SELECT digest FROM uploads where id=?))" );
+                statement failed ( "UPDATE uploads set attempts=attempts+1,"
+                    " next_attempt=datetime('now', ?) where id=?" );
+
+                bool ok = true;
+                BOOST_FOREACH ( auto const& id, uploaded_ids )
+                {
+                    ok = ok && uploaded.bind ( 1, id ).exec()
+                            && blob.bind ( 1, id ).exec()
+                            && members.bind ( 1, id ).exec();
+                }
+                BOOST_FOREACH ( auto const& r, retries )
+                {
+                    ok = ok && failed.bind ( 1, r.second ).bind ( 2, r.first ).exec();
+                }
+                return ok;
+            } );
+
+            if ( !ok )
+            {
+                LOG ( INFO ) << "Could not update upload status in database.";
+            }
+        }
 
-        error = sqlite3_exec(sql, stmt.str().c_str(), 0, 0, 0);
-        if (error)
+        // The breaker only counts batches where the server could not be
+        // reached or refused every row. A rejected session is not an
+        // outage, but it shows nothing about the server either, so a batch
+        // that was only rejected leaves a half-open breaker probing.
+        bool rejected_only = me->batch_failed_ && !me->server_failed_
+                             && me->uploaded_ids_.empty();
+        if ( me->server_failed_ && me->uploaded_ids_.empty() )
+            me->breaker_->failed();
+        else if ( !rejected_only )
+            me->breaker_->succeeded();
+
+        if ( me->breaker_->current() == circuit_breaker::open )
         {
-            LOG(INFO) << "Could not update upload status in database.";
+            LOG ( WARNING ) << "Uploads suspended for "
+                            << me->breaker_->cooldown().total_seconds() << " seconds.";
         }
 
+        // While the scheduler left rows pending, drain the next batch
+        // right away rather than on the next reminder tick. Class limits
+        // and blob dedupe make short batches normal during a backlog.
+        if ( !me->batch_failed_ && me->more_pending_ )
+        {
+            auto evt = Q_NEW ( gevt, EVT_EVENT_UPLOAD_REMINDER );
+            me->postFIFO ( evt );
+        }
 
         status = Q_TRAN ( &uploader::idle );
         break;
@@ -303,15 +455,16 @@ uploader::login()
 
     LOG ( INFO ) << "Logging in...";
 
+    // Drop the stale session before asking for a new one.
+    curl_easy_setopt ( curl_, CURLOPT_COOKIELIST, "ALL" );
+
     curl_easy_setopt ( curl_, CURLOPT_URL,
                        global::config()->get ( "login.url", "missing" ).c_str() );
     curl_easy_setopt ( curl_, CURLOPT_VERBOSE, 0L );
     curl_easy_setopt ( curl_, CURLOPT_HEADER, 1L );
     curl_easy_setopt ( curl_, CURLOPT_COOKIEFILE, "" );
-    curl_easy_setopt ( curl_, CURLOPT_COOKIESESSION, 1L );
     curl_easy_setopt ( curl_, CURLOPT_WRITEFUNCTION, login_callback );
     curl_easy_setopt ( curl_, CURLOPT_WRITEDATA, ( void* ) this );
-    curl_easy_setopt ( curl_, CURLOPT_FORBID_REUSE, 1L );
     string login_fields = string ( "username=" )
                           + global::config()->get ( "login.username", "missing" ) + "&"
                           + "password=" + global::config()->get ( "login.password", "missing" );
@@ -333,131 +486,50 @@ uploader::login()
     }
 }
 
-size_t
-uploader::upload_event_callback ( void* ptr, size_t size, size_t nmemb, void* userdata )
+void
+uploader::upload_batch()
 {
-    auto realsize = size * nmemb;
-    auto me = ( uploader* ) userdata;
-
-    if ( !me->reply_finished_ )
-    {
-        if ( realsize == 0 )
-        {
-            me->reply_finished_ = true;
-            me->uploaded_ = false;
-        }
-        else
-        {
-            me->reply_.assign ( ( char* ) ptr, realsize );
-
-            LOG ( INFO ) << me->reply_;
-
-            Json::Value root;
-            Json::Reader reader;
-            bool parse_ok = reader.parse ( me->reply_, root );
-            if ( parse_ok )
-            {
-                string result ( root.get ( "result", "error" ).asString() );
-                if ( result.compare ( "ok" ) == 0 )
-                {
-                    me->uploaded_ = true;
-                }
-                else
-                {
-                    me->uploaded_ = false;
-                }
-                me->reply_finished_ = true;
-            }
-        }
-
-    }
-
-    return realsize;
+    // Rows are sent concurrently by the engine; each completion is reported
+    // back to the active object as its own event, followed by one event
+    // marking the end of the batch. Rows whose blob the server already
+    // holds go out as references and are only settled once it accepts them.
+    engine_->run ( batch_,
+        boost::bind ( &uploader::upload_completed, this, _1, _2 ),
+        boost::bind ( &uploader::upload_progressed, this, _1, _2 ) );
+
+    auto evt = Q_NEW ( gevt, EVT_UPLOAD_BATCH_FINISHED );
+    this->postFIFO ( evt );
 }
 
-
 void
-uploader::upload_event ()
+uploader::upload_completed ( upload_row const& row, upload_status result )
 {
-    uploaded_ = false;
-    this->clear_reply();
-    auto type = this->event_args_.get< string > ( "type" );
-    auto reporter  = this->event_args_.get< string > ( "reporter" );
-    auto timestamp = this->event_args_.get< string > ( "timestamp" );
-    auto device = this->event_args_.get< string > ( "device" );
-    auto site = global::config()->get("node.site", "invalid-site");
-    auto node_name = global::config()->get("node.name", "invalid-node-name");
-    auto file_path = this->event_args_.get< string > ( "upload_file" );
-
-    CURLcode curl_error_;
-    struct curl_httppost* formpost_ = NULL;
-    struct curl_httppost* lastptr_ = NULL;
-
-    if ( type.compare ( "loitering" ) == 0 )
-    {
-        curl_formadd ( &formpost_, &lastptr_,
-                    CURLFORM_COPYNAME, "attachment",
-                    CURLFORM_FILE, file_path.c_str(),
-                    CURLFORM_END );
-    }
-    else if ( type.compare ( "health" ) == 0 )
-    {
-        curl_formadd ( &formpost_, &lastptr_,
-                    CURLFORM_COPYNAME, "status",
-                    CURLFORM_COPYCONTENTS, file_path.c_str(),
-                    CURLFORM_END );
-    }
-
-    curl_formadd ( &formpost_, &lastptr_,
-                   CURLFORM_COPYNAME, "type",
-                   CURLFORM_COPYCONTENTS, type.c_str(),
-                   CURLFORM_END );
-    curl_formadd ( &formpost_, &lastptr_,
-                   CURLFORM_COPYNAME, "site",
-                   CURLFORM_COPYCONTENTS, site.c_str(),
-                   CURLFORM_END );
-    curl_formadd ( &formpost_, &lastptr_,
-                    CURLFORM_COPYNAME, "nodeName",
-                    CURLFORM_COPYCONTENTS, node_name.c_str(),
-                    CURLFORM_END );
-    curl_formadd ( &formpost_, &lastptr_,
-                    CURLFORM_COPYNAME, "device",
-                    CURLFORM_COPYCONTENTS, device.c_str(),
-                    CURLFORM_END );
-    curl_formadd ( &formpost_, &lastptr_,
-                   CURLFORM_COPYNAME, "timestamp",
-                   CURLFORM_COPYCONTENTS, timestamp.c_str(),
-                   CURLFORM_END );
-
-    string upload_url;
-    if ( type.compare ( "loitering" ) == 0)
-        upload_url = global::config()->get ( "upload.url", "missing" );
-    else if ( type.compare ( "health" ) == 0 )
-        upload_url = global::config()->get ( "report.url", "missing" );
-
-    curl_easy_setopt ( this->curl_, CURLOPT_URL, upload_url.c_str() );
-    curl_easy_setopt ( this->curl_, CURLOPT_HEADER, 0L );
-    curl_easy_setopt ( this->curl_, CURLOPT_WRITEFUNCTION, upload_event_callback );
-    curl_easy_setopt ( this->curl_, CURLOPT_WRITEDATA, this );
-    curl_easy_setopt ( this->curl_, CURLOPT_POST, 1L );
-    curl_easy_setopt ( this->curl_, CURLOPT_HTTPPOST, formpost_ );
-
-    curl_error_ = curl_easy_perform ( curl_ );
-
-    if ( curl_error_ != CURLE_OK || !uploaded_ )
-    {
-        LOG ( INFO ) << curl_easy_strerror ( curl_error_ );
-        auto evt = Q_NEW ( gevt, EVT_EVENT_UPLOAD_FAILED );
-        this->postFIFO ( evt );
-    }
+    auto evt = Q_NEW ( upload_status_evt, result == upload_ok ? EVT_EVENT_UPLOADED : EVT_EVENT_UPLOAD_FAILED );
+    evt->id = row.id;
+    evt->attempts = row.attempts;
+    evt->rejected = result == upload_rejected;
+    this->postFIFO ( evt );
+}
 
-    if (uploaded_)
-    {
-        auto evt = Q_NEW ( gevt, EVT_EVENT_UPLOADED );
-        this->postFIFO ( evt );
-    }
+void
+uploader::upload_progressed ( upload_row const& row, long long offset )
+{
+    auto evt = Q_NEW ( upload_status_evt, EVT_UPLOAD_PROGRESS );
+    evt->id = row.id;
+    evt->sent_bytes = offset;
+    this->postFIFO ( evt );
+}
 
-    curl_formfree ( formpost_ );
+long
+uploader::retry_delay ( int attempts )
+{
+    // Exponential backoff from upload.retry_interval, capped at
+    // upload.max_retry_interval, with the upper half of the delay jittered
+    // so failed rows from one outage do not all come back at once.
+    double delay = retry_interval_ * std::pow ( 2.0, std::min ( attempts, 30 ) );
+    delay = std::min ( delay, double ( max_retry_interval_ ) );
+    std::uniform_real_distribution< double > jitter ( delay / 2, delay );
+    return std::max ( 1L, static_cast< long > ( jitter ( rng_ ) ) );
 }
 
 void
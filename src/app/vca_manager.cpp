@@ -85,7 +85,7 @@ private:
 
 public:
     vca_manager();
-    void log_vca_event ( gevt const * const );
+    void log_vca_event ( vca_evt const * const );
 
     void start_vca ( vca_info & );
     void handle_vca_loitering ( vca_info & );
@@ -247,7 +247,7 @@ QP::QState vca_manager::run_vca ( vca_manager * const me, QP::QEvt const * const
 
         case EVT_VCA_EVENT:
         {
-            me->log_vca_event ( static_cast < gevt const * const >(e) );
+            me->log_vca_event ( static_cast < vca_evt const * const >(e) );
 
             status = Q_HANDLED();
             break;
@@ -275,15 +275,15 @@ QP::QState vca_manager::run_vca ( vca_manager * const me, QP::QEvt const * const
         {
             LOG ( INFO ) << "Generating vca event...";
 
-            auto evt = Q_NEW ( gevt, EVT_VCA_EVENT );
-            evt->args.put ( "description", "violation event at site001" );
+            auto evt = Q_NEW ( vca_evt, EVT_VCA_EVENT );
+            evt->description = "violation event at site001";
             ptime timestamp ( microsec_clock::universal_time() );
-            evt->args.put ( "timestamp", common::get_utc_string ( timestamp ) );
-            evt->args.put ( "snapshot_path", "snapshots/vca.jpg" );
+            evt->timestamp = common::get_utc_string ( timestamp );
+            evt->snapshot_path = "snapshots/vca.jpg";
 
-            LOG ( INFO ) << evt->args.get< string > ( "timestamp" ) << ": "
-                << evt->args.get< string > ( "description" ) << ": "
-                << evt->args.get< string > ( "snapshot_path" );
+            LOG ( INFO ) << evt->timestamp << ": "
+                << evt->description << ": "
+                << evt->snapshot_path;
 
             me->postFIFO ( evt );
 
@@ -299,24 +299,14 @@ QP::QState vca_manager::run_vca ( vca_manager * const me, QP::QEvt const * const
     return status;
 }
 
-void vca_manager::log_vca_event ( gevt const * const e )
+void vca_manager::log_vca_event ( vca_evt const * const e )
 {
-    auto sql = global::get_database_handle();
-    int error;
-
-    ostringstream stmt;
-    stmt << "INSERT INTO events VALUES(NULL, "
-         << "'" << e->args.get< string > ( "timestamp" ) << "'" << ","
-         << "'" << "vca" << "'" << ","
-         << "'" << e->args.get< string > ( "description" ) << "'" << ", "
-         << "'" << e->args.get< string > ( "snapshot_path" ) << "'" << ", "
-         << "0" << ")";
-
-    error = sqlite3_exec ( sql, stmt.str().c_str(), 0, 0, 0 );
-    if ( error )
-    {
-        LOG ( ERROR ) << "Could not register new event with database.";
-    }
+    // Raw vca output is only logged and counted. Events that need
+    // reporting are written by the analyses, whose rows a report processes
+    // and retention purges; nothing consumes a row per output line.
+    LOG ( INFO ) << "vca: " << e->timestamp << ": " << e->description
+                 << " (" << e->snapshot_path << ")";
+    global::stat_add ( "vca.output_lines", 1 );
 }
 
 void vca_manager::handle_vca_loitering ( vca_info& info )
@@ -378,15 +368,15 @@ vca_manager::handle_vca_colorfulness ( vca_info& info )
     string line;
     while ( std::getline ( in, line ) )
     {
-        auto evt = Q_NEW ( gevt, EVT_VCA_EVENT );
-        evt->args.put ( "description", line );
+        auto evt = Q_NEW ( vca_evt, EVT_VCA_EVENT );
+        evt->description.swap ( line );
         ptime timestamp ( microsec_clock::universal_time() );
-        evt->args.put ( "timestamp", common::get_utc_string ( timestamp ) );
+        evt->timestamp = common::get_utc_string ( timestamp );
 
         path local_folder ( global::config()->get ( "vca.snapshot_dir", "snapshots" ) );
         path local_file ( info.name + " " + common::get_utc_string ( timestamp ) + ".jpg" );
         path absolute=operator/ ( local_folder, local_file );
-        evt->args.put ( "snapshot_path", absolute.string() );
+        evt->snapshot_path = absolute.string();
 
         ostringstream url;
         url << "http://localhost:" << httpport << "/frame.jpg";
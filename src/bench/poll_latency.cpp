@@ -0,0 +1,193 @@
+// Measures how long the uploader and report polling queries take as the
+// uploads and events tables grow, before and after the schema upgrades.
+//
+// usage: poll_latency [rows...]   (default: 100000 1000000)
+
+#include "schema.hpp"
+
+#include <glog/logging.h>
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace
+{
+
+char const* const database_file = "poll_latency.sqlite3";
+
+// Pending rows stay a small, constant set while history grows, as on a
+// node whose uploads keep up.
+const int pending_rows = 50;
+const int polls = 200;
+
+char const* const upload_poll =
+    "SELECT uploads.*, IFNULL(blobs.uploaded, 0) FROM uploads"
+    " LEFT JOIN blobs ON blobs.digest=uploads.digest"
+    " WHERE uploads.uploaded=0"
+    " AND (next_attempt IS NULL OR next_attempt <= datetime('now'))"
+    " AND type=? ORDER BY uploads.id LIMIT 20";
+
+char const* const event_poll =
+    "SELECT * FROM events WHERE processed=0 and reporter=?";
+
+void exec ( sqlite3* sql, char const* stmt )
+{
+    if ( sqlite3_exec ( sql, stmt, 0, 0, 0 ) != SQLITE_OK )
+    {
+        std::cerr << sqlite3_errmsg ( sql ) << ": " << stmt << std::endl;
+        std::exit ( 1 );
+    }
+}
+
+// Tables as init_database creates them at schema version 0.
+void create_tables ( sqlite3* sql )
+{
+    exec ( sql, "CREATE TABLE events (id INTEGER PRIMARY KEY,"
+                " timestamp DATETIME NOT NULL, type TEXT NOT NULL,"
+                " reporter TEXT_NOT_NULL, device TEXT_NOT_NULL,"
+                " description TEXT NOT NULL, processed INTEGER NOT NULL)" );
+    exec ( sql, "CREATE TABLE uploads (id INTEGER PRIMARY KEY,"
+                " timestamp DATETIME NOT NULL, type TEXT NOT NULL,"
+                " reporter TEXT_NOT_NULL, device TEXT_NOT_NULL,"
+                " upload_file TEXT NOT NULL, uploaded INTEGER NOT NULL,"
+                " attempts INTEGER NOT NULL DEFAULT 0, next_attempt DATETIME,"
+                " sent_bytes INTEGER NOT NULL DEFAULT 0, digest TEXT)" );
+    exec ( sql, "CREATE TABLE blobs (digest TEXT PRIMARY KEY,"
+                " size INTEGER NOT NULL, uploaded INTEGER NOT NULL DEFAULT 0)" );
+}
+
+void fill ( sqlite3* sql, int rows )
+{
+    sqlite3_stmt* upload;
+    sqlite3_stmt* event;
+
+    sqlite3_prepare_v2 ( sql, "INSERT INTO uploads"
+        " (timestamp, type, reporter, device, upload_file, uploaded, digest)"
+        " VALUES ('2014-01-01 00:00:00.000', ?, 'loiter-1', 'camera-1',"
+        " 'data/loiter-1/20140101T000000/camera-1/20140101T000000.jpg', ?, ?)",
+        -1, &upload, NULL );
+    sqlite3_prepare_v2 ( sql, "INSERT INTO events"
+        " (timestamp, type, reporter, device, description, processed)"
+        " VALUES ('2014-01-01 00:00:00.000', 'loitering', ?, 'camera-1', 'vca', ?)",
+        -1, &event, NULL );
+
+    char digest[65];
+    exec ( sql, "BEGIN" );
+    for ( int i = 0; i < rows; ++i )
+    {
+        bool pending = i >= rows - pending_rows;
+        std::snprintf ( digest, sizeof ( digest ), "%064x", i );
+
+        sqlite3_bind_text ( upload, 1, i % 4 ? "loitering" : "health", -1, SQLITE_STATIC );
+        sqlite3_bind_int ( upload, 2, pending ? 0 : 1 );
+        sqlite3_bind_text ( upload, 3, digest, -1, SQLITE_TRANSIENT );
+        sqlite3_step ( upload );
+        sqlite3_reset ( upload );
+
+        string reporter = "loiter-" + std::to_string ( i % 4 );
+        sqlite3_bind_text ( event, 1, reporter.c_str(), -1, SQLITE_TRANSIENT );
+        sqlite3_bind_int ( event, 2, pending ? 0 : 1 );
+        sqlite3_step ( event );
+        sqlite3_reset ( event );
+    }
+    exec ( sql, "COMMIT" );
+
+    sqlite3_finalize ( upload );
+    sqlite3_finalize ( event );
+}
+
+void explain ( sqlite3* sql, char const* query )
+{
+    sqlite3_stmt* stmt;
+    string plan = string ( "EXPLAIN QUERY PLAN " ) + query;
+
+    sqlite3_prepare_v2 ( sql, plan.c_str(), -1, &stmt, NULL );
+    sqlite3_bind_text ( stmt, 1, "loitering", -1, SQLITE_STATIC );
+    while ( sqlite3_step ( stmt ) == SQLITE_ROW )
+    {
+        std::cout << "    plan: "
+                  << reinterpret_cast< const char * > ( sqlite3_column_text ( stmt, 3 ) )
+                  << std::endl;
+    }
+    sqlite3_finalize ( stmt );
+}
+
+// Runs the query the way the pollers do and returns the median latency.
+double median_microseconds ( sqlite3* sql, char const* query, char const* parameter )
+{
+    sqlite3_stmt* stmt;
+    vector< double > samples;
+
+    sqlite3_prepare_v2 ( sql, query, -1, &stmt, NULL );
+    for ( int i = 0; i < polls; ++i )
+    {
+        auto start = std::chrono::steady_clock::now();
+        sqlite3_bind_text ( stmt, 1, parameter, -1, SQLITE_STATIC );
+        while ( sqlite3_step ( stmt ) == SQLITE_ROW )
+            ;
+        sqlite3_reset ( stmt );
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        samples.push_back ( std::chrono::duration< double, std::micro > ( elapsed ).count() );
+    }
+    sqlite3_finalize ( stmt );
+
+    std::sort ( samples.begin(), samples.end() );
+    return samples[samples.size() / 2];
+}
+
+void report ( sqlite3* sql, int rows, char const* label )
+{
+    std::cout << rows << " rows, " << label << ":" << std::endl;
+    std::cout << "  uploads poll: "
+              << median_microseconds ( sql, upload_poll, "loitering" ) << " us" << std::endl;
+    explain ( sql, upload_poll );
+    std::cout << "  events poll:  "
+              << median_microseconds ( sql, event_poll, "loiter-1" ) << " us" << std::endl;
+    explain ( sql, event_poll );
+}
+
+}
+
+int main ( int argc, char* argv[] )
+{
+    FLAGS_logtostderr = 1;
+    google::InitGoogleLogging ( argv[0] );
+
+    vector< int > sizes;
+    for ( int i = 1; i < argc; ++i )
+        sizes.push_back ( std::atoi ( argv[i] ) );
+    if ( sizes.empty() )
+        sizes = { 100000, 1000000 };
+
+    for ( auto rows : sizes )
+    {
+        sqlite3* sql;
+        std::remove ( database_file );
+        if ( sqlite3_open ( database_file, &sql ) != SQLITE_OK )
+        {
+            std::cerr << "Could not open " << database_file << std::endl;
+            return 1;
+        }
+
+        create_tables ( sql );
+        fill ( sql, rows );
+
+        report ( sql, rows, "schema version 0" );
+        app::upgrade_schema ( sql );
+        report ( sql, rows, "current schema" );
+
+        sqlite3_close ( sql );
+        std::remove ( database_file );
+    }
+
+    return 0;
+}
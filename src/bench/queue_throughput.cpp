@@ -0,0 +1,99 @@
+// Compares squeue with ring_queue on a stream of small items handed from
+// 1, 2 and 4 producer threads to one consumer, as detections are.
+//
+// usage: queue_throughput [items]   (default: 2000000)
+
+#include "ring_queue.hpp"
+#include "squeue.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+const size_t capacity = 1024;
+
+// A detection as it goes through the queue: a frame number and a few
+// fields, trivially copied.
+struct detection
+{
+    long frame;
+    int x;
+    int y;
+};
+
+template < typename Queue >
+double run ( Queue& queue, int producers, long items )
+{
+    long per_producer = items / producers;
+    long total = per_producer * producers;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector< std::thread > threads;
+    for ( int p = 0; p < producers; ++p )
+    {
+        threads.push_back ( std::thread ( [ &queue, per_producer, p ] {
+            detection d = { 0, p, 0 };
+            for ( long i = 0; i < per_producer; ++i )
+            {
+                d.frame = i;
+                queue.push ( d );
+            }
+        } ) );
+    }
+
+    long received = 0;
+    long checksum = 0;
+    detection d;
+    while ( received < total && queue.pop ( d ) )
+    {
+        checksum += d.frame;
+        ++received;
+    }
+
+    for ( auto& t : threads )
+        t.join();
+
+    double seconds = std::chrono::duration< double > (
+        std::chrono::steady_clock::now() - start ).count();
+
+    if ( checksum != producers * ( per_producer * ( per_producer - 1 ) / 2 ) )
+    {
+        std::cerr << "lost items" << std::endl;
+        std::exit ( 1 );
+    }
+    return total / seconds;
+}
+
+}
+
+int main ( int argc, char* argv[] )
+{
+    long items = argc > 1 ? std::atol ( argv[1] ) : 2000000;
+
+    std::printf ( "%-10s %16s %16s %16s\n", "producers",
+                  "squeue", "squeue bounded", "ring_queue" );
+
+    int counts[] = { 1, 2, 4 };
+    for ( int producers : counts )
+    {
+        squeue< detection > unbounded;
+        squeue< detection > bounded ( capacity, overflow_block );
+        ring_queue< detection > ring ( capacity, overflow_block );
+
+        double a = run ( unbounded, producers, items );
+        double b = run ( bounded, producers, items );
+        double c = run ( ring, producers, items );
+
+        std::printf ( "%-10d %12.2f M/s %12.2f M/s %12.2f M/s\n",
+                      producers, a / 1e6, b / 1e6, c / 1e6 );
+    }
+
+    return 0;
+}